@@ -0,0 +1,73 @@
+#include <sol-base.hpp>
+#include <cstdio>
+#include <atomic>
+
+using Clock = std::chrono::steady_clock;
+
+// Measures how many tasks per second an `EventLoop` runs when they're queued on its own thread and when other threads post them, and how long a posted task waits before it runs
+int main() {
+    sol::Init();
+    const std::size_t count = 2000000;
+    std::size_t ran = 0;
+    auto start = Clock::now();
+    sol::Thread::New([&ran, count](){
+        sol::EventLoop* loop = sol::CurrentEventLoop();
+        for (std::size_t i = 0; i < count; i++) {
+            loop->QueueMacrotask([&ran](){
+                ran++;
+            });
+        }
+        loop->Run();
+    })->Wait();
+    printf("local macrotasks: %.0f tasks/s\n", ran / std::chrono::duration<double>(Clock::now() - start).count());
+    std::atomic<bool> ready = false;
+    sol::EventLoop* loop = NULL;
+    auto host = [&](){
+        loop = sol::CurrentEventLoop();
+        loop->Ref();
+        ready = true;
+        loop->Run();
+    };
+    // Four threads post as fast as they can
+    const std::size_t posters = 4;
+    ran = 0;
+    ready = false;
+    sol::Thread* t = sol::Thread::New(host);
+    while (!ready) std::this_thread::yield();
+    start = Clock::now();
+    std::vector<std::thread> threads;
+    std::atomic<std::size_t> left = posters;
+    for (std::size_t p = 0; p < posters; p++) {
+        threads.emplace_back([&](){
+            for (std::size_t i = 0; i < count / posters; i++) {
+                loop->Post([&ran](){
+                    ran++;
+                });
+            }
+            if (--left == 0) loop->Unref();
+        });
+    }
+    for (auto& i : threads) i.join();
+    t->Wait();
+    printf("posted from %zu threads: %.0f tasks/s\n", posters, ran / std::chrono::duration<double>(Clock::now() - start).count());
+    // One task in flight at a time, so the time is the loop waking up and not a backlog
+    const std::size_t pings = 20000;
+    std::atomic<bool> done;
+    double total = 0;
+    ready = false;
+    t = sol::Thread::New(host);
+    while (!ready) std::this_thread::yield();
+    for (std::size_t i = 0; i < pings; i++) {
+        done = false;
+        auto sent = Clock::now();
+        loop->Post([&done, &total, sent](){
+            total += std::chrono::duration<double, std::micro>(Clock::now() - sent).count();
+            done = true;
+        });
+        while (!done) std::this_thread::yield();
+    }
+    loop->Unref();
+    t->Wait();
+    printf("post to run latency: %.2f us\n", total / pings);
+    sol::Teardown();
+}
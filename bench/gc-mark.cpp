@@ -0,0 +1,37 @@
+#include <sol-base.hpp>
+#include <cstdio>
+#include <cstdlib>
+
+// Times full collections of a heap where everything is reachable, so the collection is almost all marking, with 1, 2, 4 and 8 marker threads
+int main(int argc, char** argv) {
+    std::size_t count = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+    const std::size_t fanout = 16;
+    sol::Init();
+    // A tree where every value references up to `fanout` others, built breadth first so it's `count` values in total
+    std::vector<sol::Value> level = {sol::Value::NewSymbol()};
+    std::size_t made = 1;
+    while (made < count) {
+        std::vector<sol::Value> next;
+        for (auto& parent : level) {
+            for (std::size_t i = 0; i < fanout && made < count; i++, made++) {
+                sol::Value child = sol::Value::NewSymbol();
+                parent.AddReference(child);
+                child.MakeNotPersistent();
+                next.push_back(child);
+            }
+        }
+        level = std::move(next);
+    }
+    printf("%zu values\n", made);
+    for (std::size_t threads : {1, 2, 4, 8}) {
+        sol::SetGCMarkerThreads(threads);
+        // The first collection also starts the marker threads
+        sol::CollectGarbage();
+        const int runs = 5;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < runs; i++) sol::CollectGarbage();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+        printf("%zu marker threads: %.1f ms per collection\n", threads, ms);
+    }
+    sol::Teardown();
+}
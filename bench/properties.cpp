@@ -0,0 +1,30 @@
+#include <sol-base.hpp>
+#include <cstdio>
+#include <string>
+
+// Times `CoreGet` and `CoreSet` by atom on values with a growing number of properties. With shapes both should stay flat as the count grows
+int main() {
+    sol::Init();
+    std::vector<sol::Atom> keys;
+    for (int i = 0; i < 256; i++) {
+        std::string key = "prop" + std::to_string(i);
+        keys.push_back(sol::Intern(sol::vec8(key.begin(), key.end())));
+    }
+    for (std::size_t count : {1, 4, 16, 64, 256}) {
+        sol::Value val = sol::Value::NewSymbol();
+        for (std::size_t i = 0; i < count; i++) val.CoreSet(keys[i], (void*)(uintptr_t)(i + 1));
+        const std::size_t ops = 10000000;
+        uintptr_t sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < ops; i++) sum += (uintptr_t)val.CoreGet(keys[i % count]);
+        double get = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ops;
+        start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < ops; i++) val.CoreSet(keys[i % count], (void*)(uintptr_t)i);
+        double set = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ops;
+        // Every slot holds a non-zero value, this only keeps the reads from being optimized out
+        if (sum == 0) return 1;
+        printf("%zu properties: Get %.1f ns, Set %.1f ns\n", count, get, set);
+        val.Collect();
+    }
+    sol::Teardown();
+}
@@ -0,0 +1,24 @@
+#include <sol-base.hpp>
+#include <cstdio>
+#include <string>
+
+// Measures `utf8ToString` throughput in GB/s of UTF-8 input, for ASCII, mostly ASCII, and text with no ASCII at all. It takes its input by value, so each run includes copying it
+int main() {
+    const std::size_t size = 16 * 1024 * 1024;
+    std::pair<const char*, std::string> samples[] = {
+        {"ascii", "The quick brown fox jumps over the lazy dog. "},
+        {"mixed", "Grüße aus Köln, ça va? Ελληνικά! "},
+        {"cjk", "日本語のテキストと中文文本"},
+        {"emoji", "😀🚀🌍🎉"}
+    };
+    for (auto& sample : samples) {
+        sol::vec8 input;
+        while (input.size() < size) input.insert(input.end(), sample.second.begin(), sample.second.end());
+        const int runs = 10;
+        std::size_t units = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < runs; i++) units += sol::utf8ToString(input).Size();
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%s: %.2f GB/s (%zu code units)\n", sample.first, input.size() * (double)runs / secs / 1e9, units / runs);
+    }
+}
@@ -1,97 +1,1340 @@
 #include <sol-base.hpp>
-#include <map>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
 #include <algorithm>
 #include <iostream>
 #include <cmath>
-#include <gmpxx.h>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <condition_variable>
+#include <chrono>
+#if defined(__linux__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+// Defining `SOL_NO_IO_URING` makes the poller always use epoll
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup) && !defined(SOL_NO_IO_URING)
+#include <linux/io_uring.h>
+#define SOL_IO_URING
+#endif
+#endif
 
 namespace sol {
+    struct VecHash {
+        std::size_t operator()(const vec8& v) const {
+            return std::hash<std::string_view>()(std::string_view((const char*)v.data(), v.size()));
+        }
+    };
+    // The encoding of `Value::_`. Doubles are stored as themselves with NaNs canonicalized, everything else uses the negative NaN space
+    namespace tag {
+        const uint64_t Mask = 0xFFFF000000000000;
+        const uint64_t Object = 0xFFF9000000000000;
+        const uint64_t Int = 0xFFFA000000000000;
+        const uint64_t Bool = 0xFFFB000000000000;
+        const uint64_t Undefined = 0xFFFC000000000000;
+        const uint64_t Null = 0xFFFD000000000000;
+        const uint64_t NaN = 0x7FF8000000000000;
+    }
+    std::unordered_set<vec8, VecHash> atoms;
+    std::mutex atoms_m;
+    // A hidden class: the key-to-slot layout shared by every `BaseValue` whose keys were added in the same order
+    struct Shape {
+        std::size_t count = 0;
+        std::unordered_map<Atom, std::size_t> table;
+        std::unordered_map<Atom, Shape*> transitions;
+        // Returns the slot of `key`, or `count` if this shape doesn't have it
+        std::size_t Lookup(Atom key) {
+            auto it = table.find(key);
+            if (it == table.end()) return count;
+            return it->second;
+        }
+        Shape* Transition(Atom key);
+        void Clear() {
+            for (auto i : transitions) {
+                i.second->Clear();
+                delete i.second;
+            }
+            transitions.clear();
+        }
+    };
+    Shape rootShape;
+    std::mutex shapes_m;
+    Shape* Shape::Transition(Atom key) {
+        shapes_m.lock();
+        auto it = transitions.find(key);
+        if (it != transitions.end()) {
+            SOL_MUNLOCKRET(shapes_m, it->second)
+        }
+        Shape* res = new Shape;
+        res->count = count + 1;
+        res->table = table;
+        res->table[key] = count;
+        transitions[key] = res;
+        SOL_MUNLOCKRET(shapes_m, res)
+    }
+    namespace gc {
+        struct Handles;
+    }
+    // The kinds of heap values. Each has its own layout and an entry in `kindOps`
+    enum Kind : uint8_t {
+        KindString,
+        KindSymbol
+    };
     struct BaseValue {
-        std::vector<std::pair<vec8, void*>> props;
+        Kind kind;
+        // Whether the last trace reached this value
+        std::atomic<bool> marked = false;
+        // Whether this value survived a collection. Young values live in `gc::young`, old ones in `gc::all`
+        bool old = false;
+        // Whether this value is in `gc::remembered`
+        bool remembered = false;
+        // Where this value is in `gc::all` or `gc::young`
+        std::size_t gcIndex;
+        // `gc::PersistentBit` if the value is persistent, plus one for every `Persistent` handle to it
+        std::atomic<uint32_t> roots = 0;
+        // The handles and slot this value was put in if it was made while a `HandleScope` was open
+        gc::Handles* scope = NULL;
+        std::size_t scopeIndex = 0;
+        // How many entries in other values' `refs` point to this value
+        std::size_t incoming = 0;
+        // The values this value keeps alive
+        std::vector<BaseValue*> refs;
+        Shape* shape = &rootShape;
+        std::vector<void*> slots;
+        // Only taken once the value is made shared, until then it is confined to the thread that created it
         std::mutex m;
-        void Set(vec8 key, void* val) {
-            m.lock();
-            for (std::size_t i = 0; i < props.size(); i++) {
-                if (vec8Compare(props[i].first, key)) {
-                    props[i] = std::make_pair(key, val);
-                    SOL_MUNLOCK(m)
-                }
+        std::atomic<bool> shared = false;
+        BaseValue(Kind k) : kind(k) {}
+        void SetUnlocked(Atom key, void* val) {
+            std::size_t i = shape->Lookup(key);
+            if (i < shape->count) {
+                slots[i] = val;
+                return;
             }
-            props.push_back(std::make_pair(key, val));
+            shape = shape->Transition(key);
+            slots.push_back(val);
+        }
+        void* GetUnlocked(Atom key) {
+            std::size_t i = shape->Lookup(key);
+            if (i < shape->count) return slots[i];
+            return NULL;
+        }
+        void Set(Atom key, void* val) {
+            if (!shared.load(std::memory_order_acquire)) return SetUnlocked(key, val);
+            m.lock();
+            SetUnlocked(key, val);
             SOL_MUNLOCK(m)
         }
-        void* Get(vec8 key) {
+        void* Get(Atom key) {
+            if (!shared.load(std::memory_order_acquire)) return GetUnlocked(key);
             m.lock();
-            for (std::size_t i = 0; i < props.size(); i++) {
-                if (vec8Compare(props[i].first, key)) {
-                    auto res = props[i].second;
-                    SOL_MUNLOCKRET(m, res)
-                }
+            auto res = GetUnlocked(key);
+            SOL_MUNLOCKRET(m, res)
+        }
+        bool Has(Atom key) {
+            if (!shared.load(std::memory_order_acquire)) return shape->Lookup(key) < shape->count;
+            m.lock();
+            bool res = shape->Lookup(key) < shape->count;
+            SOL_MUNLOCKRET(m, res)
+        }
+    };
+    // The contents of a string value: flat, a rope of two other nodes, a buffer owned by the embedder, or a slice of another node. Nodes never change once made, so values and other nodes can share them
+    struct StringNode {
+        enum Type : uint8_t {
+            TypeFlat,
+            TypeCons,
+            TypeExternal,
+            TypeSlice
+        };
+        Type type;
+        // Whether every code unit is known to fit in a byte
+        bool oneByte;
+        // How many cons nodes deep this node goes, 0 for flat ones
+        uint8_t depth = 0;
+        std::atomic<std::size_t> rc = 1;
+        std::size_t length;
+        // The hash of the code units, 0 until it's first needed
+        std::atomic<uint64_t> hash = 0;
+        // Whether this is the node the intern table hands out for its contents
+        std::atomic<bool> interned = false;
+        // The code units, one byte or two bytes each, for every node that can be read directly. Ropes and non-ASCII UTF-8 buffers have neither
+        const uint8_t* bytes = NULL;
+        const uint16_t* chars = NULL;
+        // Only for flat nodes, kept one byte per code unit whenever it fits
+        BaseString flat;
+        // Only for cons nodes, the two halves in order
+        StringNode* left = NULL;
+        StringNode* right = NULL;
+        // Only for slice nodes, the direct node the code units are read from and where in it they start
+        StringNode* parent = NULL;
+        std::size_t offset = 0;
+        // Only for external nodes
+        const void* external = NULL;
+        std::size_t externalSize = 0;
+        Encoding encoding;
+        // Whether the UTF-8 buffer has no invalid sequences, so it can be handed out as is
+        bool validUtf8 = false;
+        voidfn release;
+        static StringNode* NewFlat(BaseString str);
+        // Makes this a flat node holding `str`. Only for new nodes and ones nothing else uses
+        void SetFlat(BaseString str);
+        static StringNode* NewExternal(const void* data, std::size_t size, Encoding encoding, voidfn release);
+        // Returns the code units of the direct node `node` from `start` to `end`, sharing its storage unless that would keep much more alive than it uses
+        static StringNode* Slice(StringNode* node, std::size_t start, std::size_t end);
+        // Returns `left` followed by `right`, taking over the caller's references to both
+        static StringNode* Concat(StringNode* left, StringNode* right);
+        // Returns a balanced rope with the same contents as `node`, taking over the caller's reference to it
+        static StringNode* Balance(StringNode* node);
+        void Retain();
+        void Release();
+        // Returns the contents as one `BaseString`
+        BaseString Flatten();
+        // Copies the contents to `out` starting at `offset`. `out` must be sized already and two bytes wide unless this node is one byte
+        void CopyTo(BaseString& out, std::size_t offset);
+        // Adds the leaves under this node to `leaves`, retained
+        void Leaves(std::vector<StringNode*>& leaves);
+        // Returns whether the code units can be read directly with `At`
+        bool Direct() {
+            return type == TypeFlat || type == TypeSlice || (type == TypeExternal && encoding != EncodingUtf8);
+        }
+        // Returns whether the code unit at `i` of a direct node is a surrogate that stays on its own
+        bool Literal(std::size_t i) {
+            const std::vector<bool>& lits = type == TypeSlice ? parent->flat.litchars : flat.litchars;
+            if (type == TypeSlice) i += offset;
+            return i < lits.size() && lits[i];
+        }
+        uint16_t At(std::size_t i) {
+            return bytes != NULL ? bytes[i] : chars[i];
+        }
+        // Returns the hash of a direct node's code units, computing it the first time
+        uint64_t Hash();
+        // Returns whether two direct nodes have the same code units
+        bool UnitsEqual(StringNode* other);
+    };
+    struct StringNodeHash {
+        std::size_t operator()(StringNode* node) const {
+            return node->Hash();
+        }
+    };
+    // Interned nodes must match exactly, lone surrogate marks included, so interning never changes how a string encodes
+    struct StringNodeEqual {
+        bool operator()(StringNode* a, StringNode* b) const {
+            if (!a->UnitsEqual(b)) return false;
+            for (std::size_t i = 0; i < a->length; i++) {
+                if (a->Literal(i) != b->Literal(i)) return false;
             }
-            SOL_MUNLOCKRET(m, NULL)
+            return true;
         }
-        bool Has(vec8 key) {
+    };
+    // Part of the string intern table. Nodes are spread across the shards by hash so threads interning different strings rarely share a lock
+    struct InternShard {
+        std::mutex m;
+        std::unordered_set<StringNode*, StringNodeHash, StringNodeEqual> nodes;
+    };
+    const std::size_t InternShardCount = 16;
+    InternShard internShards[InternShardCount];
+    // Returns the interned node with the same contents as the direct node `node`, interning `node` if there's none yet. Takes over the caller's reference to `node` and returns a retained one
+    StringNode* InternNode(StringNode* node) {
+        if (node->interned.load(std::memory_order_acquire)) return node;
+        InternShard& shard = internShards[node->Hash() % InternShardCount];
+        shard.m.lock();
+        auto it = shard.nodes.find(node);
+        if (it == shard.nodes.end()) {
+            // The table keeps the caller's reference and hands out a new one
+            node->interned.store(true, std::memory_order_release);
+            shard.nodes.insert(node);
+            node->Retain();
+            SOL_MUNLOCKRET(shard.m, node)
+        }
+        StringNode* res = *it;
+        res->Retain();
+        shard.m.unlock();
+        node->Release();
+        return res;
+    }
+    // Ropes deeper than this are rebalanced
+    const std::size_t MaxRopeDepth = 64;
+    // Concatenations shorter than this are copied into a flat node, tiny ropes cost more than they save
+    const std::size_t MinRopeLength = 13;
+    // Rebalancing merges neighbouring leaves up to this many code units
+    const std::size_t RopeLeafLength = 4096;
+    // Joining a short string onto the flat leaf at the end of a rope copies it into a new leaf instead of adding a level, while the leaf stays shorter than this
+    const std::size_t RopeExtendLength = 256;
+    // Slices shorter than this are copied, they're cheaper to copy than to track
+    const std::size_t MinSliceLength = 13;
+    // Slices that use less than one in this many of their parent's code units are copied, so they don't keep a much bigger string alive
+    const std::size_t MaxSliceWaste = 8;
+    struct StringObject : BaseValue {
+        StringNode* node;
+        StringObject(StringNode* n) : BaseValue(KindString), node(n) {}
+        ~StringObject() {
+            node->Release();
+        }
+        // Returns `node` retained, so it stays alive even if the value is set meanwhile
+        StringNode* Load() {
+            if (!shared.load(std::memory_order_acquire)) {
+                node->Retain();
+                return node;
+            }
             m.lock();
-            for (std::size_t i = 0; i < props.size(); i++) {
-                if (vec8Compare(props[i].first, key)) {
-                    SOL_MUNLOCKRET(m, true)
-                }
+            StringNode* res = node;
+            res->Retain();
+            SOL_MUNLOCKRET(m, res)
+        }
+        // Replaces `node` with `n`, taking over the caller's reference to it
+        void Store(StringNode* n) {
+            bool locked = shared.load(std::memory_order_acquire);
+            if (locked) m.lock();
+            StringNode* old = node;
+            node = n;
+            if (locked) m.unlock();
+            old->Release();
+        }
+        // Returns `node` ready to be changed in place, first swapping in a flat copy of it unless it's flat and nothing else uses it. The caller must hold `m` if the value is shared
+        StringNode* Unique() {
+            if (node->type == StringNode::TypeFlat && node->rc.load(std::memory_order_acquire) == 1) return node;
+            StringNode* old = node;
+            node = StringNode::NewFlat(old->Flatten());
+            old->Release();
+            return node;
+        }
+        // Like `Load`, but flattens the node first unless it can be read directly, and keeps the flat node so it's only flattened once
+        StringNode* LoadFlat() {
+            StringNode* res = Load();
+            if (res->Direct()) return res;
+            StringNode* flat = StringNode::NewFlat(res->Flatten());
+            res->Release();
+            flat->Retain();
+            Store(flat);
+            return flat;
+        }
+    };
+    // A symbol's description. Readers copy it without a lock, so a replaced one is only freed once no reader can still be copying it
+    struct SymbolDescription {
+        BaseString str;
+        // The next one in `SymbolData::retired`
+        SymbolDescription* older = NULL;
+    };
+    // What every copy of a symbol shares. Its address is the symbol's identity
+    struct SymbolData {
+        // A unique number for the symbol, in creation order
+        uint64_t id;
+        std::atomic<std::size_t> rc = 1;
+        std::atomic<SymbolDescription*> description = NULL;
+        // How many threads are copying the description right now
+        std::atomic<std::size_t> readers = 0;
+        // Replaced descriptions that readers might still be copying
+        std::atomic<SymbolDescription*> retired = NULL;
+        // The interned key it was registered with by `SymbolFor`, `NULL` if it wasn't. Set before the symbol is handed out and never changed
+        StringNode* registryKey = NULL;
+        ~SymbolData() {
+            delete description.load();
+            FreeDescriptions(retired.load());
+        }
+        // Copies the description to `out`, returning whether there is one
+        bool GetDescription(BaseString& out) {
+            readers++;
+            SymbolDescription* desc = description.load();
+            if (desc != NULL) out = desc->str;
+            readers--;
+            return desc != NULL;
+        }
+        void SetDescription(BaseString str) {
+            SymbolDescription* desc = new SymbolDescription;
+            desc->str = std::move(str);
+            SymbolDescription* old = description.exchange(desc);
+            if (old == NULL) return;
+            Retire(old, old);
+            // What was retired before seeing no readers can go, since readers that start later only find newer descriptions. Otherwise it waits for the next change
+            SymbolDescription* taken = retired.exchange(NULL);
+            if (taken == NULL) return;
+            if (readers.load() == 0) {
+                FreeDescriptions(taken);
+                return;
+            }
+            SymbolDescription* last = taken;
+            while (last->older != NULL) last = last->older;
+            Retire(taken, last);
+        }
+        // Pushes the descriptions from `first` to `last`, linked by `older`, onto `retired`
+        void Retire(SymbolDescription* first, SymbolDescription* last) {
+            SymbolDescription* head = retired.load();
+            do {
+                last->older = head;
+            } while (!retired.compare_exchange_weak(head, first));
+        }
+        static void FreeDescriptions(SymbolDescription* desc) {
+            while (desc != NULL) {
+                SymbolDescription* older = desc->older;
+                delete desc;
+                desc = older;
+            }
+        }
+    };
+    std::atomic<uint64_t> symbolIds = 0;
+    struct SymbolObject : BaseValue {
+        SymbolData* data;
+        SymbolObject(SymbolData* d) : BaseValue(KindSymbol), data(d) {}
+        ~SymbolObject() {
+            if (data->rc.fetch_sub(1, std::memory_order_acq_rel) == 1) delete data;
+        }
+    };
+    // A symbol in the global registry. Entries are never removed, so they can be read without a lock
+    struct RegistryEntry {
+        StringNode* key;
+        SymbolData* data;
+    };
+    // The global symbol registry, an open addressing table with linear probing. Readers never lock, adding takes `registry_m` and publishes each slot with a single store. A table that grows is replaced instead of resized, and kept until teardown since readers may still be probing it
+    struct RegistryTable {
+        std::size_t capacity;
+        std::size_t count = 0;
+        std::unique_ptr<std::atomic<RegistryEntry*>[]> slots;
+        RegistryTable* older;
+        RegistryTable(std::size_t cap, RegistryTable* o) : capacity(cap), slots(new std::atomic<RegistryEntry*>[cap]), older(o) {
+            for (std::size_t i = 0; i < capacity; i++) slots[i].store(NULL, std::memory_order_relaxed);
+        }
+        // Returns the entry whose key has the contents of the direct node `key`, `NULL` if there's none
+        RegistryEntry* Find(StringNode* key) {
+            for (std::size_t i = key->Hash() & (capacity - 1); true; i = (i + 1) & (capacity - 1)) {
+                RegistryEntry* entry = slots[i].load(std::memory_order_acquire);
+                if (entry == NULL) return NULL;
+                if (StringNodeEqual()(entry->key, key)) return entry;
             }
-            SOL_MUNLOCKRET(m, false)
+        }
+        // Only with `registry_m` held
+        void Insert(RegistryEntry* entry) {
+            std::size_t i = entry->key->Hash() & (capacity - 1);
+            while (slots[i].load(std::memory_order_relaxed) != NULL) i = (i + 1) & (capacity - 1);
+            slots[i].store(entry, std::memory_order_release);
+            count++;
+        }
+    };
+    std::atomic<RegistryTable*> registry = NULL;
+    std::mutex registry_m;
+    // The operations every kind of heap value implements
+    struct KindOps {
+        Value (*copy)(BaseValue* val);
+        void (*destroy)(BaseValue* val);
+    };
+    extern const KindOps kindOps[];
+    bool IsBase(Value v) {
+        return (v._ & tag::Mask) == tag::Object;
+    }
+    BaseValue* ToBase(Value v) {
+        return (BaseValue*)(uintptr_t)(v._ & ~tag::Mask);
+    }
+    Value FromBase(void* v) {
+        Value res;
+        res._ = tag::Object | (uint64_t)(uintptr_t)v;
+        return res;
+    }
+    // A Chase-Lev work-stealing deque. Only its owner may `Push` and `Pop`, any thread may `Steal`
+    template<typename T>
+    struct WorkDeque {
+        struct Array {
+            std::size_t size;
+            std::atomic<T>* items;
+            Array(std::size_t n) : size(n), items(new std::atomic<T>[n]) {}
+            ~Array() {
+                delete[] items;
+            }
+            T Get(int64_t i) {
+                return items[i & (size - 1)].load(std::memory_order_relaxed);
+            }
+            void Put(int64_t i, T val) {
+                items[i & (size - 1)].store(val, std::memory_order_relaxed);
+            }
+        };
+        std::atomic<int64_t> top = 0;
+        std::atomic<int64_t> bottom = 0;
+        std::atomic<Array*> array = new Array(64);
+        // Arrays outgrown by `Push`, kept until the deque dies since thieves may still be reading them
+        std::vector<Array*> retired;
+        ~WorkDeque() {
+            delete array.load();
+            for (auto i : retired) delete i;
+        }
+        void Push(T val) {
+            int64_t b = bottom.load(std::memory_order_relaxed);
+            int64_t t = top.load(std::memory_order_acquire);
+            Array* a = array.load(std::memory_order_relaxed);
+            if (b - t >= (int64_t)a->size) {
+                Array* grown = new Array(a->size * 2);
+                for (int64_t i = t; i < b; i++) grown->Put(i, a->Get(i));
+                retired.push_back(a);
+                array.store(grown, std::memory_order_release);
+                a = grown;
+            }
+            a->Put(b, val);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        bool Pop(T& out) {
+            int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+            Array* a = array.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t t = top.load(std::memory_order_relaxed);
+            if (t > b) {
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return false;
+            }
+            out = a->Get(b);
+            if (t < b) return true;
+            // Last item, race the thieves for it
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        bool Steal(T& out) {
+            int64_t t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = bottom.load(std::memory_order_acquire);
+            if (t >= b) return false;
+            out = array.load(std::memory_order_acquire)->Get(t);
+            return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        }
+        bool Empty() {
+            return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
         }
     };
     namespace gc {
-        std::vector<void*> all;
-        std::vector<void*> persistent;
-        std::map<void*, std::vector<void*>> refs;
+        const uint32_t PersistentBit = 0x80000000;
+        // The old generation size under which allocation never triggers a full collection
+        const std::size_t MinThreshold = 1024;
+        // How many young values are allocated between minor collections
+        const std::size_t NurseryLimit = 4096;
+        // Values are allocated from chunks of this size, aligned to it so a value can find its chunk from its address
+        const std::size_t ChunkSize = 64 * 1024;
+        // How many empty chunks are kept around for reuse
+        const std::size_t ChunkPoolSize = 16;
+        // What every value's address is aligned to
+        const std::size_t Align = alignof(std::max_align_t);
+        // Every chunk holds values of one size, a multiple of `Align` up to this many of it
+        const std::size_t SizeClasses = 64;
+        // A freed slot, reused before the chunk is bumped any further
+        struct Hole {
+            Hole* next;
+        };
+        struct Chunk {
+            char* top;
+            // How many registered values live in this chunk
+            std::size_t live;
+            // Whether no thread allocates from this chunk any more
+            bool retired;
+            std::size_t sizeClass;
+            // Slots to allocate from. Only the owning thread uses them while the chunk isn't retired
+            Hole* free;
+            // Slots freed while a thread owns the chunk, which it takes with `gc_m` locked once `free` runs out
+            Hole* pending;
+            // Where this chunk is in `recyclable`, or `SIZE_MAX` if it isn't
+            std::size_t recycleIndex;
+        };
+        // The chunks the current thread allocates from, one per size class
+        struct Nursery {
+            Chunk* chunks[SizeClasses] = {};
+            std::size_t epoch = 0;
+            ~Nursery();
+        };
+        thread_local Nursery nursery;
+        // Bumped when the whole heap is freed, so threads know to drop their nursery chunks
+        std::atomic<std::size_t> epoch = 1;
+        std::unordered_set<Chunk*> chunks;
+        std::vector<Chunk*> chunkPool;
+        // Retired chunks that still have live values and free slots, by size class. Threads take these before new chunks, so a few survivors don't keep a whole chunk to themselves
+        std::vector<Chunk*> recyclable[SizeClasses];
+        std::vector<BaseValue*> all;
+        std::vector<BaseValue*> young;
+        // The local handles of one thread. Only that thread pushes, with `gc_m` locked, and closing a scope only moves `count` back, so collectors can read them without stopping it
+        struct Handles {
+            static const std::size_t BlockSize = 1024;
+            std::vector<BaseValue**> blocks;
+            std::atomic<std::size_t> count = 0;
+            std::size_t depth = 0;
+            ~Handles() {
+                for (auto i : blocks) delete[] i;
+            }
+            BaseValue*& At(std::size_t i) {
+                return blocks[i / BlockSize][i % BlockSize];
+            }
+            void Push(BaseValue* val);
+        };
+        // The handles of every thread that ever opened a `HandleScope`. They live until the program exits, exited threads give theirs back to `freeHandles`
+        std::vector<std::unique_ptr<Handles>> handles;
+        std::vector<Handles*> freeHandles;
+        struct HandlesSlot {
+            Handles* handles = NULL;
+            ~HandlesSlot();
+        };
+        thread_local HandlesSlot currentHandles;
+        // Set while incremental marking runs, so rooting a value knows to take the slow path and shade it
+        std::atomic<bool> marking = false;
+        // How far incremental marking got scanning `all` and then `young` for rooted values
+        std::size_t rootCursor = 0;
+        // The roots a parallel mark splits between its workers
+        std::vector<BaseValue*> markRoots;
+        // Old values that were given a reference to a young value since the last collection
+        std::vector<BaseValue*> remembered;
+        std::size_t threshold = MinThreshold;
         std::mutex gc_m;
+        // Heaps smaller than this are always marked by the collecting thread alone
+        const std::size_t ParallelThreshold = 16384;
+        // How many threads mark during a full collection, counting the collecting thread
+        std::size_t markers = std::max(1u, std::thread::hardware_concurrency());
+        // Markers sleep between collections, so they get threads of their own instead of tying up scheduler workers
+        std::vector<std::thread> markerPool;
+        std::vector<WorkDeque<BaseValue*>*> markDeques;
+        std::mutex marker_m;
+        std::condition_variable marker_cv;
+        std::size_t markerJob = 0;
+        std::size_t markersDone = 0;
+        std::size_t markWorkers = 0;
+        bool markersStop = false;
+        std::atomic<std::size_t> markIdle;
+        // Where a collection cycle is. Only `PhaseIdle` lets minor collections and `Value::Collect` free values right away
+        enum Phase {
+            PhaseIdle,
+            PhaseMarking,
+            PhaseDropRefs,
+            PhaseSweeping
+        };
+        Phase phase = PhaseIdle;
+        // Whether growing the heap starts an incremental cycle instead of a full collection
+        bool incremental = false;
+        // How much marking or sweeping each allocation does while an incremental cycle is running
+        const std::size_t AllocationStep = 64;
+        // Marked values whose references weren't traced yet
+        std::vector<BaseValue*> gray;
+        // What `all` and `young` held when marking ended, waiting to be swept
+        std::vector<BaseValue*> unsweptOld;
+        std::vector<BaseValue*> unsweptYoung;
+        std::size_t dropCursor = 0;
+        // How much work a step may do, as a deadline and a count of values visited
+        struct Budget {
+            std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+            std::size_t work = SIZE_MAX;
+            bool Spend() {
+                if (work == 0) return false;
+                work--;
+                if ((work & 63) == 0 && std::chrono::steady_clock::now() >= deadline) work = 0;
+                return true;
+            }
+        };
+        void MarkerLoop(std::size_t id);
+        void MarkWorker(std::size_t id);
+        void StopMarkers();
+        // Allocates `size` bytes from the current thread's nursery chunk for that size, reusing freed slots first
+        void* Allocate(std::size_t size);
+        Chunk* ChunkOf(BaseValue* val);
+        // Returns the current thread's handles, only locking `gc_m` the first time
+        Handles* CurrentHandles();
+        // Called when a value goes from having no roots to having some, to keep incremental marking from missing it
+        void Rooted(BaseValue* val);
+        // All of these expect `gc_m` to be locked
+        Chunk* NewChunk(std::size_t sizeClass);
+        // Returns a chunk for `sizeClass` with room, preferring a recyclable one
+        Chunk* TakeChunk(std::size_t sizeClass);
+        void Retire(Chunk* chunk);
+        void Unrecycle(Chunk* chunk);
+        void Release(BaseValue* val);
+        void Destroy(BaseValue* val);
+        void Register(BaseValue* val);
+        void Remember(BaseValue* val);
+        void Free(BaseValue* val);
+        void Minor();
+        void Shade(BaseValue* val);
+        void StartCycle();
+        bool MarkSlice(Budget& budget);
+        void ParallelMark();
+        void Snapshot();
+        bool DropRefsSlice(Budget& budget);
+        bool SweepSlice(Budget& budget);
+        // Returns whether the cycle finished
+        bool Step(Budget& budget);
+        void Collect();
+        void FreeAll();
     }
-    std::map<std::thread::id, Thread*> threads;
+    // Allocates a `T` in the nursery. The result should be passed to `mknew` right away
+    template<typename T, typename... Args>
+    T* Make(Args&&... args) {
+        static_assert(sizeof(T) <= gc::SizeClasses * gc::Align, "too big for the nursery's size classes");
+        return new (gc::Allocate(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+    // The `Thread` this OS thread is running right now
+    thread_local Thread* currentThread = NULL;
+    // The `Thread`s made with `Thread::New`. They own the ones spawned under them and live until teardown
+    std::vector<Thread*> rootThreads;
     std::mutex threads_m;
-    mpf_t symnum;
-    std::vector<std::pair<mpf_ptr, BaseString>> symdescs;
-    std::mutex sym_m;
-}
-
-std::function<sol::Value()> mknew(std::function<sol::BaseValue*()> fn) {
-    return [fn](){
-        sol::gc::gc_m.lock();
-        sol::BaseValue* val = fn();
-        sol::Value res;
-        res._ = val;
-        sol::gc::all.push_back(val);
-        sol::gc::persistent.push_back(val);
-        sol::gc::refs[val] = std::vector<void*>();
-        SOL_MUNLOCKRET(sol::gc::gc_m, res)
+    // The work-stealing scheduler `Thread`s run on. A fixed set of workers each own a deque, the tasks a worker spawns go on its own deque and idle workers steal from the others
+    namespace sched {
+        struct Worker {
+            std::size_t index;
+            WorkDeque<Thread*> tasks;
+        };
+        std::vector<Worker*> workers;
+        // Tasks submitted from threads that aren't workers
+        std::deque<Thread*> injected;
+        std::atomic<std::size_t> injectedCount = 0;
+        // How many tasks are waiting to run anywhere, and how many workers are asleep waiting for one
+        std::atomic<std::size_t> queued = 0;
+        std::atomic<std::size_t> sleeping = 0;
+        bool stop = false;
+        std::mutex sched_m;
+        std::condition_variable sched_cv;
+        thread_local Worker* currentWorker = NULL;
+        // Workers handed off by threads about to block, and the threads waiting to take them. Every thread the workers were ever run on is in `threads`
+        std::vector<Worker*> handoffs;
+        std::size_t idleSpares = 0;
+        std::condition_variable spare_cv;
+        std::vector<std::thread> threads;
+        void Start();
+        // Stops the workers once every `Thread` is done
+        void Stop();
+        // Queues `th` to run on some worker
+        void Submit(Thread* th);
+        // Runs one queued task if there's any, returning whether it did. Only for workers
+        bool RunOne(Worker* w);
+        void Run(Thread* th);
+        // Called when `th`'s code or one of its children is done
+        void Finish(Thread* th);
+        void WorkerLoop(Worker* w);
+        // Hands the current thread's worker to a spare thread, so its tasks keep running while this one blocks. Does nothing if it isn't a worker
+        void Park();
+        // Runs the workers handed to it until the scheduler stops
+        void SpareLoop();
+    }
+#if defined(__linux__)
+    namespace io {
+        struct Op {
+            enum Kind : uint8_t {
+                KindRead,
+                KindWrite,
+                KindReadFixed,
+                // The read of `wakeFd` that wakes the io_uring poller
+                KindWake
+            };
+            Kind kind;
+            int fd;
+            void* buf;
+            std::size_t size;
+            int64_t offset;
+            std::size_t index = 0;
+            Callback done;
+            EventLoop* loop = NULL;
+        };
+        // The operations waiting for an fd to be ready, only for epoll
+        struct Waiting {
+            std::deque<Op*> reads;
+            std::deque<Op*> writes;
+            // What the fd is registered for
+            uint32_t events = 0;
+        };
+        // How many submissions the io_uring ring holds
+        const unsigned RingEntries = 256;
+        bool uring = false;
+        std::atomic<bool> stopping = false;
+        std::thread poller;
+        // Guards `buffers`, `queued` and the io_uring submission ring
+        std::mutex io_m;
+        // Written to wake the poller when there's something new to submit or it should stop
+        int wakeFd = -1;
+        uint64_t wakeCount;
+        Op* wakeOp = NULL;
+        std::vector<Buffer> buffers;
+        bool buffersRegistered = false;
+#if defined(SOL_IO_URING)
+        int ringFd = -1;
+        void* sqRing;
+        std::size_t sqRingSize;
+        void* cqRing;
+        std::size_t cqRingSize;
+        io_uring_sqe* sqes;
+        std::size_t sqesSize;
+        unsigned* sqHead;
+        unsigned* sqTail;
+        unsigned* sqArray;
+        unsigned sqMask;
+        unsigned sqEntries;
+        unsigned* cqHead;
+        unsigned* cqTail;
+        unsigned cqMask;
+        io_uring_cqe* cqes;
+        // Submissions queued on the ring that the kernel wasn't told about yet
+        unsigned unsubmitted = 0;
+#endif
+        int epollFd = -1;
+        // Operations the epoll poller hasn't started yet
+        std::vector<Op*> queued;
+        // Only used by the epoll poller
+        std::unordered_map<int, Waiting> waiting;
+        void Start();
+        void Stop();
+        // Returns whether io_uring could be set up
+        bool StartUring();
+        void Submit(Op* op);
+        void Wake();
+        // Expects `io_m` to be locked
+        void QueueSqe(Op* op);
+        // Posts `op`'s callback to its loop and frees it
+        void Deliver(Op* op, int64_t res);
+        void UringLoop();
+        void EpollLoop();
+        // Starts an operation the epoll poller took from `queued`
+        void Begin(Op* op);
+        // Does `op` once, returning `-EAGAIN` if it would block
+        int64_t Perform(Op* op);
+        // Retries the operations waiting on `fd` after epoll reported `events`, then updates what it's registered for
+        void Ready(int fd, uint32_t events);
+        void Update(int fd);
+    }
+#endif
+}
+
+sol::gc::Nursery::~Nursery() {
+    if (std::count(std::begin(chunks), std::end(chunks), (Chunk*)NULL) == SizeClasses) return;
+    gc_m.lock();
+    if (epoch == gc::epoch) {
+        for (auto i : chunks) {
+            if (i != NULL) Retire(i);
+        }
+    }
+    SOL_MUNLOCK(gc_m)
+}
+
+void* sol::gc::Allocate(std::size_t size) {
+    size = (size + Align - 1) & ~(Align - 1);
+    std::size_t sizeClass = size / Align - 1;
+    Nursery& n = nursery;
+    if (n.epoch != epoch) {
+        std::fill(std::begin(n.chunks), std::end(n.chunks), (Chunk*)NULL);
+        n.epoch = epoch;
+    }
+    Chunk* chunk = n.chunks[sizeClass];
+    if (chunk == NULL || (chunk->free == NULL && chunk->top + size > (char*)chunk + ChunkSize)) {
+        gc_m.lock();
+        if (chunk != NULL && chunk->pending != NULL) {
+            chunk->free = chunk->pending;
+            chunk->pending = NULL;
+        } else {
+            if (chunk != NULL) Retire(chunk);
+            chunk = TakeChunk(sizeClass);
+            n.chunks[sizeClass] = chunk;
+        }
+        gc_m.unlock();
+    }
+    if (chunk->free != NULL) {
+        Hole* res = chunk->free;
+        chunk->free = res->next;
+        return res;
+    }
+    void* res = chunk->top;
+    chunk->top += size;
+    return res;
+}
+
+sol::gc::Chunk* sol::gc::ChunkOf(BaseValue* val) {
+    return (Chunk*)((uintptr_t)val & ~(uintptr_t)(ChunkSize - 1));
+}
+
+sol::gc::Chunk* sol::gc::NewChunk(std::size_t sizeClass) {
+    Chunk* res;
+    if (!chunkPool.empty()) {
+        res = chunkPool.back();
+        chunkPool.pop_back();
+    } else {
+        res = (Chunk*)std::aligned_alloc(ChunkSize, ChunkSize);
+    }
+    res->top = (char*)res + ((sizeof(Chunk) + Align - 1) & ~(Align - 1));
+    res->live = 0;
+    res->retired = false;
+    res->sizeClass = sizeClass;
+    res->free = NULL;
+    res->pending = NULL;
+    res->recycleIndex = SIZE_MAX;
+    chunks.insert(res);
+    return res;
+}
+
+sol::gc::Chunk* sol::gc::TakeChunk(std::size_t sizeClass) {
+    std::vector<Chunk*>& list = recyclable[sizeClass];
+    if (list.empty()) return NewChunk(sizeClass);
+    Chunk* res = list.back();
+    Unrecycle(res);
+    res->retired = false;
+    return res;
+}
+
+void sol::gc::Retire(Chunk* chunk) {
+    chunk->retired = true;
+    if (chunk->pending != NULL) {
+        Hole* last = chunk->pending;
+        while (last->next != NULL) last = last->next;
+        last->next = chunk->free;
+        chunk->free = chunk->pending;
+        chunk->pending = NULL;
+    }
+    if (chunk->live > 0) {
+        bool room = chunk->free != NULL || chunk->top + (chunk->sizeClass + 1) * Align <= (char*)chunk + ChunkSize;
+        if (room && chunk->recycleIndex == SIZE_MAX) {
+            std::vector<Chunk*>& list = recyclable[chunk->sizeClass];
+            chunk->recycleIndex = list.size();
+            list.push_back(chunk);
+        }
+        return;
+    }
+    Unrecycle(chunk);
+    chunks.erase(chunk);
+    if (chunkPool.size() < ChunkPoolSize) chunkPool.push_back(chunk);
+    else std::free(chunk);
+}
+
+void sol::gc::Unrecycle(Chunk* chunk) {
+    if (chunk->recycleIndex == SIZE_MAX) return;
+    std::vector<Chunk*>& list = recyclable[chunk->sizeClass];
+    list[chunk->recycleIndex] = list.back();
+    list[chunk->recycleIndex]->recycleIndex = chunk->recycleIndex;
+    list.pop_back();
+    chunk->recycleIndex = SIZE_MAX;
+}
+
+void sol::gc::Release(BaseValue* val) {
+    Chunk* chunk = ChunkOf(val);
+    chunk->live--;
+    Hole* hole = (Hole*)(void*)val;
+    if (chunk->retired) {
+        hole->next = chunk->free;
+        chunk->free = hole;
+        Retire(chunk);
+    } else {
+        hole->next = chunk->pending;
+        chunk->pending = hole;
+    }
+}
+
+void sol::gc::Destroy(BaseValue* val) {
+    kindOps[val->kind].destroy(val);
+    Release(val);
+}
+
+void sol::gc::Register(BaseValue* val) {
+    ChunkOf(val)->live++;
+    // Values made while marking are black, so the cycle never frees them
+    val->marked = phase == PhaseMarking;
+    val->gcIndex = young.size();
+    young.push_back(val);
+    Handles* h = currentHandles.handles;
+    if (h != NULL && h->depth > 0) h->Push(val);
+    else val->roots = PersistentBit;
+}
+
+void sol::gc::Handles::Push(BaseValue* val) {
+    std::size_t i = count.load(std::memory_order_relaxed);
+    if (i == blocks.size() * BlockSize) blocks.push_back(new BaseValue*[BlockSize]);
+    At(i) = val;
+    val->scope = this;
+    val->scopeIndex = i;
+    count.store(i + 1, std::memory_order_release);
+}
+
+sol::gc::HandlesSlot::~HandlesSlot() {
+    if (handles == NULL) return;
+    gc_m.lock();
+    handles->count = 0;
+    handles->depth = 0;
+    freeHandles.push_back(handles);
+    SOL_MUNLOCK(gc_m)
+}
+
+sol::gc::Handles* sol::gc::CurrentHandles() {
+    HandlesSlot& slot = currentHandles;
+    if (slot.handles != NULL) return slot.handles;
+    gc_m.lock();
+    if (!freeHandles.empty()) {
+        slot.handles = freeHandles.back();
+        freeHandles.pop_back();
+    } else {
+        slot.handles = new Handles;
+        handles.push_back(std::unique_ptr<Handles>(slot.handles));
+    }
+    SOL_MUNLOCKRET(gc_m, slot.handles)
+}
+
+void sol::gc::Rooted(BaseValue* val) {
+    if (!marking.load()) return;
+    gc_m.lock();
+    if (phase == PhaseMarking) Shade(val);
+    SOL_MUNLOCK(gc_m)
+}
+
+void sol::gc::Remember(BaseValue* val) {
+    if (val->remembered) return;
+    val->remembered = true;
+    remembered.push_back(val);
+}
+
+void sol::gc::Free(BaseValue* val) {
+    if (val->scope != NULL && val->scope->At(val->scopeIndex) == val) val->scope->At(val->scopeIndex) = NULL;
+    if (val->remembered) remembered.erase(std::find(remembered.begin(), remembered.end(), val));
+    auto& gen = val->old ? all : young;
+    BaseValue* last = gen.back();
+    gen[val->gcIndex] = last;
+    last->gcIndex = val->gcIndex;
+    gen.pop_back();
+    for (auto i : val->refs) i->incoming--;
+    Destroy(val);
+}
+
+void sol::gc::Minor() {
+    // Only young values are traced. Old ones count as alive, and the remembered set stands in for the old-to-young references
+    std::vector<BaseValue*> stack;
+    auto visit = [&stack](BaseValue* val) {
+        if (val->old || val->marked) return;
+        val->marked = true;
+        stack.push_back(val);
     };
+    for (auto i : young) {
+        if (i->roots.load() != 0) visit(i);
+    }
+    for (auto& h : handles) {
+        std::size_t count = h->count.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < count; i++) {
+            if (h->At(i) != NULL) visit(h->At(i));
+        }
+    }
+    for (auto i : remembered) {
+        i->remembered = false;
+        for (auto j : i->refs) visit(j);
+    }
+    remembered.clear();
+    while (!stack.empty()) {
+        BaseValue* val = stack.back();
+        stack.pop_back();
+        for (auto i : val->refs) visit(i);
+    }
+    for (auto i : young) {
+        if (i->marked) continue;
+        for (auto j : i->refs) {
+            if (j->old || j->marked) j->incoming--;
+        }
+    }
+    // Survivors are promoted in place, values are never moved since embedders hold their addresses
+    for (auto i : young) {
+        if (!i->marked) {
+            Destroy(i);
+            continue;
+        }
+        i->marked = false;
+        i->old = true;
+        i->gcIndex = all.size();
+        all.push_back(i);
+    }
+    young.clear();
 }
 
-std::function<void()>* mkcollect(sol::BaseValue* val, std::function<void()> fn) {
-    return new std::function([val,fn](){
-        sol::gc::gc_m.lock();
-        fn();
-        std::size_t i = 0;
-        while (i < sol::gc::all.size()) {
-            if (sol::gc::all[i] == val) break;
-            i++;
+void sol::gc::Shade(BaseValue* val) {
+    if (val->marked) return;
+    val->marked = true;
+    gray.push_back(val);
+}
+
+void sol::gc::StartCycle() {
+    phase = PhaseMarking;
+    marking = true;
+    rootCursor = 0;
+    for (auto& h : handles) {
+        std::size_t count = h->count.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < count; i++) {
+            if (h->At(i) != NULL) Shade(h->At(i));
+        }
+    }
+}
+
+bool sol::gc::MarkSlice(Budget& budget) {
+    while (true) {
+        if (!gray.empty()) {
+            if (!budget.Spend()) return false;
+            BaseValue* val = gray.back();
+            gray.pop_back();
+            for (auto i : val->refs) Shade(i);
+            continue;
+        }
+        // Rooted values are found by scanning the heap, values rooted behind the cursor are shaded by `Rooted`
+        if (rootCursor < all.size() + young.size()) {
+            if (!budget.Spend()) return false;
+            BaseValue* val = rootCursor < all.size() ? all[rootCursor] : young[rootCursor - all.size()];
+            rootCursor++;
+            if (val->roots.load() != 0) Shade(val);
+            continue;
+        }
+        return true;
+    }
+}
+
+void sol::gc::Snapshot() {
+    marking = false;
+    unsweptOld.swap(all);
+    unsweptYoung.swap(young);
+    // Every young value is promoted or freed by the sweep, so nothing old can point at a young one any more
+    for (auto i : remembered) i->remembered = false;
+    remembered.clear();
+    dropCursor = 0;
+    phase = PhaseDropRefs;
+}
+
+bool sol::gc::DropRefsSlice(Budget& budget) {
+    // Dead values may point at each other, so drop their references to live values before freeing any of them
+    while (dropCursor < unsweptOld.size() + unsweptYoung.size()) {
+        if (!budget.Spend()) return false;
+        BaseValue* val = dropCursor < unsweptOld.size() ? unsweptOld[dropCursor] : unsweptYoung[dropCursor - unsweptOld.size()];
+        dropCursor++;
+        if (val->marked) continue;
+        for (auto i : val->refs) {
+            if (i->marked) i->incoming--;
         }
-        sol::gc::all.erase(sol::gc::all.begin() + i);
-        i = 0;
-        bool persistent = false;
-        while (i < sol::gc::persistent.size()) {
-            if (sol::gc::persistent[i] == val) {
-                persistent = true;
+    }
+    phase = PhaseSweeping;
+    return true;
+}
+
+bool sol::gc::SweepSlice(Budget& budget) {
+    for (auto gen : {&unsweptOld, &unsweptYoung}) {
+        while (!gen->empty()) {
+            if (!budget.Spend()) return false;
+            BaseValue* val = gen->back();
+            gen->pop_back();
+            if (!val->marked) {
+                Destroy(val);
+                continue;
+            }
+            val->marked = false;
+            val->gcIndex = all.size();
+            all.push_back(val);
+            if (val->old) continue;
+            val->old = true;
+            // It may have been given references to values made after the snapshot, which are still young
+            for (auto i : val->refs) {
+                if (i->old) continue;
+                Remember(val);
                 break;
             }
-            i++;
         }
-        if (persistent) sol::gc::persistent.erase(sol::gc::persistent.begin() + i);
-        auto it = sol::gc::refs.find(val);
-        sol::gc::refs.erase(it);
-        SOL_MUNLOCK(sol::gc::gc_m)
+    }
+    phase = PhaseIdle;
+    threshold = std::max(MinThreshold, all.size() * 2);
+    return true;
+}
+
+bool sol::gc::Step(Budget& budget) {
+    if (phase == PhaseMarking) {
+        if (!MarkSlice(budget)) return false;
+        Snapshot();
+    }
+    if (phase == PhaseDropRefs && !DropRefsSlice(budget)) return false;
+    if (phase == PhaseSweeping && !SweepSlice(budget)) return false;
+    return true;
+}
+
+void sol::gc::ParallelMark() {
+    std::size_t n = markers;
+    markRoots.clear();
+    for (auto gen : {&all, &young}) {
+        for (auto i : *gen) {
+            if (i->roots.load() != 0) markRoots.push_back(i);
+        }
+    }
+    for (auto& h : handles) {
+        std::size_t count = h->count.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < count; i++) {
+            if (h->At(i) != NULL) markRoots.push_back(h->At(i));
+        }
+    }
+    std::unique_lock lock(marker_m);
+    while (markerPool.size() < n - 1) {
+        std::size_t id = markerPool.size() + 1;
+        markerPool.push_back(std::thread([id](){
+            MarkerLoop(id);
+        }));
+    }
+    while (markDeques.size() < n) markDeques.push_back(new WorkDeque<BaseValue*>);
+    markWorkers = n;
+    markersDone = 0;
+    markIdle = 0;
+    markerJob++;
+    lock.unlock();
+    marker_cv.notify_all();
+    MarkWorker(0);
+    lock.lock();
+    marker_cv.wait(lock, [](){
+        return markersDone == markWorkers - 1;
     });
 }
 
+void sol::gc::MarkerLoop(std::size_t id) {
+    std::size_t seen = 0;
+    std::unique_lock lock(marker_m);
+    while (true) {
+        marker_cv.wait(lock, [&seen](){
+            return markersStop || markerJob != seen;
+        });
+        if (markersStop) return;
+        seen = markerJob;
+        if (id >= markWorkers) continue;
+        lock.unlock();
+        MarkWorker(id);
+        lock.lock();
+        markersDone++;
+        marker_cv.notify_all();
+    }
+}
+
+void sol::gc::MarkWorker(std::size_t id) {
+    WorkDeque<BaseValue*>& own = *markDeques[id];
+    auto visit = [&own](BaseValue* val) {
+        if (val->marked.load(std::memory_order_relaxed) || val->marked.exchange(true)) return;
+        own.Push(val);
+    };
+    for (std::size_t i = id; i < markRoots.size(); i += markWorkers) visit(markRoots[i]);
+    BaseValue* val;
+    while (true) {
+        while (own.Pop(val)) {
+            for (auto i : val->refs) visit(i);
+        }
+        bool stolen = false;
+        for (std::size_t i = 1; i < markWorkers && !stolen; i++) {
+            stolen = markDeques[(id + i) % markWorkers]->Steal(val);
+        }
+        if (stolen) {
+            for (auto i : val->refs) visit(i);
+            continue;
+        }
+        // Marking is over once every worker is out of work at the same time
+        markIdle++;
+        while (true) {
+            if (markIdle == markWorkers) return;
+            bool work = false;
+            for (std::size_t i = 0; i < markWorkers && !work; i++) work = !markDeques[i]->Empty();
+            if (work) {
+                markIdle--;
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+}
+
+void sol::gc::StopMarkers() {
+    marker_m.lock();
+    markersStop = true;
+    marker_m.unlock();
+    marker_cv.notify_all();
+    for (auto& i : markerPool) i.join();
+    for (auto i : markDeques) delete i;
+    markerPool.clear();
+    markDeques.clear();
+    markersStop = false;
+    markerJob = 0;
+}
+
+void sol::gc::Collect() {
+    Budget unlimited;
+    // Finish whatever incremental cycle is running, then do a full one so garbage made since it started goes too
+    if (phase != PhaseIdle) Step(unlimited);
+    if (markers > 1 && all.size() + young.size() >= ParallelThreshold) {
+        phase = PhaseMarking;
+        ParallelMark();
+    } else {
+        StartCycle();
+        MarkSlice(unlimited);
+    }
+    Snapshot();
+    Step(unlimited);
+}
+
+void sol::gc::FreeAll() {
+    for (auto gen : {&all, &young, &unsweptOld, &unsweptYoung}) {
+        for (auto i : *gen) kindOps[i->kind].destroy(i);
+        gen->clear();
+    }
+    for (auto i : chunks) std::free(i);
+    for (auto i : chunkPool) std::free(i);
+    for (auto& i : handles) i->count = 0;
+    remembered.clear();
+    gray.clear();
+    phase = PhaseIdle;
+    marking = false;
+    chunks.clear();
+    chunkPool.clear();
+    for (auto& i : recyclable) i.clear();
+    epoch++;
+    threshold = MinThreshold;
+}
+
+sol::Value mknew(sol::BaseValue* val) {
+    sol::gc::gc_m.lock();
+    if (sol::gc::phase != sol::gc::PhaseIdle) {
+        sol::gc::Budget budget;
+        budget.work = sol::gc::AllocationStep;
+        sol::gc::Step(budget);
+    } else {
+        if (sol::gc::young.size() >= sol::gc::NurseryLimit) sol::gc::Minor();
+        if (sol::gc::all.size() >= sol::gc::threshold) {
+            if (sol::gc::incremental) sol::gc::StartCycle();
+            else sol::gc::Collect();
+        }
+    }
+    sol::gc::Register(val);
+    SOL_MUNLOCKRET(sol::gc::gc_m, sol::FromBase(val))
+}
+
+void mkcollect(sol::BaseValue* val) {
+    sol::gc::gc_m.lock();
+    // Values other values still point at, that `Persistent` handles still hold, or that a running cycle may be tracing, are left for the collector to free
+    bool held = (val->roots.load() & ~sol::gc::PersistentBit) != 0;
+    if (val->incoming > 0 || held || sol::gc::phase != sol::gc::PhaseIdle) val->roots.fetch_and(~sol::gc::PersistentBit);
+    else sol::gc::Free(val);
+    SOL_MUNLOCK(sol::gc::gc_m)
+}
+
+const sol::KindOps sol::kindOps[] = {
+    // KindString
+    {
+        [](BaseValue* val) {
+            // Copies share the node, it's only cloned once one of them is changed
+            return mknew(Make<StringObject>(((StringObject*)val)->Load()));
+        },
+        [](BaseValue* val) {
+            ((StringObject*)val)->~StringObject();
+        }
+    },
+    // KindSymbol
+    {
+        [](BaseValue* val) {
+            // Copies are the same symbol, so they share its identity and description
+            SymbolData* data = ((SymbolObject*)val)->data;
+            data->rc.fetch_add(1, std::memory_order_relaxed);
+            return mknew(Make<SymbolObject>(data));
+        },
+        [](BaseValue* val) {
+            ((SymbolObject*)val)->~SymbolObject();
+        }
+    }
+};
+
 bool sol::vec8Compare(vec8 v1, vec8 v2) {
     if (v1.size() != v2.size()) return false;
     for (std::size_t i = 0; i < v1.size(); i++) {
@@ -103,49 +1346,346 @@ bool sol::vec8Compare(vec8 v1, vec8 v2) {
 auto Noop = [](){};
 
 void sol::Value::CoreSet(vec8 key, void* val) {
-    ((sol::BaseValue*)_)->Set(key, val);
+    CoreSet(Intern(key), val);
 }
 
 void* sol::Value::CoreGet(vec8 key) {
-    return ((sol::BaseValue*)_)->Get(key);
+    Atom k = FindAtom(key);
+    if (k == NULL) return NULL;
+    return CoreGet(k);
 }
 
 bool sol::Value::CoreHas(vec8 key) {
-    return ((sol::BaseValue*)_)->Has(key);
+    Atom k = FindAtom(key);
+    if (k == NULL) return false;
+    return CoreHas(k);
+}
+
+void sol::Value::CoreSet(Atom key, void* val) {
+    if (!IsBase(*this)) return;
+    ToBase(*this)->Set(key, val);
+}
+
+void* sol::Value::CoreGet(Atom key) {
+    if (!IsBase(*this)) return NULL;
+    return ToBase(*this)->Get(key);
+}
+
+bool sol::Value::CoreHas(Atom key) {
+    if (!IsBase(*this)) return false;
+    return ToBase(*this)->Has(key);
 }
 
 sol::Thread* sol::Thread::New(voidfn code) {
-    threads_m.lock();
     Thread* th = new Thread;
-    th->t = std::thread([code,th](){
-        th->tm.lock();
-        code();
-        th->tm.unlock();
+    th->code = std::move(code);
+    threads_m.lock();
+    rootThreads.push_back(th);
+    threads_m.unlock();
+    sched::Submit(th);
+    return th;
+}
+
+sol::Thread* sol::Thread::Spawn(voidfn code) {
+    Thread* res = new Thread;
+    res->code = std::move(code);
+    res->parent = this;
+    tm.lock();
+    pending++;
+    st.push_back(res);
+    tm.unlock();
+    sched::Submit(res);
+    return res;
+}
+
+void sol::Thread::Wait() {
+    // A worker runs the children that haven't started yet itself, since it has to wait for them anyway. Any other task could end up stuck underneath this until it's done
+    while (sched::currentWorker != NULL && pending.load(std::memory_order_acquire) != 0) {
+        Thread* next = NULL;
+        tm.lock();
+        while (next == NULL && claimed < st.size()) {
+            Thread* i = st[claimed++];
+            if (!i->started.load()) next = i;
+        }
+        tm.unlock();
+        if (next == NULL) break;
+        sched::Run(next);
+    }
+    // The rest are running elsewhere, so the worker goes to a spare thread instead of sitting idle while this blocks
+    if (pending.load(std::memory_order_acquire) != 0) sched::Park();
+    std::unique_lock lock(tm);
+    done.wait(lock, [this](){
+        return pending.load(std::memory_order_acquire) == 0;
     });
-    th->w = std::thread([th](){
-        th->wm.lock();
+}
+
+sol::EventLoop* sol::Thread::Loop() {
+    EventLoop* res = loop.load(std::memory_order_acquire);
+    if (res != NULL) return res;
+    EventLoop* made = new EventLoop;
+    if (loop.compare_exchange_strong(res, made, std::memory_order_acq_rel)) return made;
+    delete made;
+    return res;
+}
+
+sol::Thread::~Thread() {
+    for (auto i : st) delete i;
+    delete loop.load();
+}
+
+sol::EventLoop::EventLoop() : postedHead(&stub), postedTail(&stub) {}
+
+sol::EventLoop::~EventLoop() {
+    Posted* i = postedTail;
+    while (i != NULL) {
+        Posted* next = i->next.load();
+        if (i != &stub) delete i;
+        i = next;
+    }
+}
+
+void sol::EventLoop::QueueMicrotask(voidfn code) {
+    microtasks.push_back(std::move(code));
+}
+
+void sol::EventLoop::QueueMacrotask(voidfn code) {
+    macrotasks.push_back(std::move(code));
+}
+
+void sol::EventLoop::Post(voidfn code) {
+    Posted* task = new Posted;
+    task->code = std::move(code);
+    Posted* prev = postedHead.exchange(task);
+    // Until this store the loop sees the queue as having a task it can't take yet, so it retries instead of sleeping
+    prev->next.store(task, std::memory_order_release);
+    if (sleeping.load()) Wake();
+}
+
+void sol::EventLoop::Ref() {
+    refs++;
+}
+
+void sol::EventLoop::Unref() {
+    if (refs.fetch_sub(1) == 1 && sleeping.load()) Wake();
+}
+
+void sol::EventLoop::Wake() {
+    // Taking the lock makes sure a loop that just saw nothing to do is waiting before it's woken
+    m.lock();
+    m.unlock();
+    wake.notify_one();
+}
+
+void sol::EventLoop::TakePosted() {
+    while (true) {
+        Posted* tail = postedTail;
+        Posted* next = tail->next.load(std::memory_order_acquire);
+        if (tail == &stub) {
+            if (next == NULL) return;
+            postedTail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next == NULL) {
+            // The newest task can only be taken once something is linked after it, so the stub goes back in behind it
+            if (tail != postedHead.load()) return;
+            stub.next.store(NULL, std::memory_order_relaxed);
+            Posted* prev = postedHead.exchange(&stub);
+            prev->next.store(&stub, std::memory_order_release);
+            next = tail->next.load(std::memory_order_acquire);
+            if (next == NULL) return;
+        }
+        postedTail = next;
+        macrotasks.push_back(std::move(tail->code));
+        delete tail;
+    }
+}
+
+bool sol::EventLoop::HasPosted() {
+    return postedTail != &stub || postedHead.load() != &stub;
+}
+
+bool sol::EventLoop::RunOnce() {
+    bool ran = false;
+    if (microtasks.empty()) {
+        TakePosted();
+        if (macrotasks.empty()) return false;
+        voidfn task = std::move(macrotasks.front());
+        macrotasks.pop_front();
+        task();
+        ran = true;
+    }
+    // Microtasks queued by microtasks run in the same drain
+    while (!microtasks.empty()) {
+        voidfn task = std::move(microtasks.front());
+        microtasks.pop_front();
+        task();
+        ran = true;
+    }
+    return ran;
+}
+
+void sol::EventLoop::Run() {
+    while (true) {
+        if (RunOnce()) continue;
+        // Running other tasks here would leave them stuck under the loop until it ends, and the loop could be waiting on them, so the worker goes to another thread instead
+        sched::Park();
+        std::unique_lock lock(m);
+        sleeping = true;
+        wake.wait(lock, [this](){
+            return HasPosted() || refs.load() == 0;
+        });
+        sleeping = false;
+        if (!HasPosted() && refs.load() == 0) return;
+    }
+}
+
+void sol::sched::Start() {
+    stop = false;
+    std::size_t n = std::max(std::thread::hardware_concurrency(), 1u);
+    for (std::size_t i = 0; i < n; i++) {
+        workers.push_back(new Worker);
+        workers[i]->index = i;
+    }
+    for (auto w : workers) {
+        threads.push_back(std::thread([w](){
+            WorkerLoop(w);
+            SpareLoop();
+        }));
+    }
+}
+
+void sol::sched::Stop() {
+    threads_m.lock();
+    std::vector<Thread*> roots = std::move(rootThreads);
+    rootThreads.clear();
+    threads_m.unlock();
+    for (auto i : roots) i->Wait();
+    sched_m.lock();
+    stop = true;
+    std::vector<std::thread> all = std::move(threads);
+    threads.clear();
+    sched_m.unlock();
+    sched_cv.notify_all();
+    spare_cv.notify_all();
+    for (auto& i : all) i.join();
+    for (auto w : workers) delete w;
+    workers.clear();
+    for (auto i : roots) delete i;
+}
+
+void sol::sched::Submit(Thread* th) {
+    Worker* w = currentWorker;
+    if (w != NULL) {
+        w->tasks.Push(th);
+    } else {
+        sched_m.lock();
+        injected.push_back(th);
+        injectedCount++;
+        sched_m.unlock();
+    }
+    queued++;
+    if (sleeping.load() == 0) return;
+    // Taking the lock makes sure a worker that just saw nothing queued is waiting before it's woken
+    sched_m.lock();
+    sched_m.unlock();
+    sched_cv.notify_one();
+}
+
+bool sol::sched::RunOne(Worker* w) {
+    Thread* th = NULL;
+    bool found = w->tasks.Pop(th);
+    if (!found && injectedCount.load() != 0) {
+        sched_m.lock();
+        if (!injected.empty()) {
+            th = injected.front();
+            injected.pop_front();
+            injectedCount--;
+            found = true;
+        }
+        sched_m.unlock();
+    }
+    std::size_t n = workers.size();
+    for (std::size_t i = 1; i < n && !found; i++) {
+        found = workers[(w->index + i) % n]->tasks.Steal(th);
+    }
+    if (!found) return false;
+    queued--;
+    Run(th);
+    return true;
+}
+
+void sol::sched::Run(Thread* th) {
+    // A parent waiting on `th` may have run it already, leaving it queued
+    if (th->started.exchange(true)) return;
+    // A parent waiting on its children runs them inside itself, and gets its own `Thread` back after
+    Thread* outer = currentThread;
+    currentThread = th;
+    th->code();
+    // The code can't run again, so whatever it captured can go now
+    th->code = voidfn();
+    currentThread = outer;
+    Finish(th);
+}
+
+void sol::sched::Finish(Thread* th) {
+    while (th != NULL) {
+        // Nothing frees `th` until a `Wait` on it has seen it finish, and that waits for `tm`
         th->tm.lock();
+        bool last = --th->pending == 0;
+        Thread* parent = th->parent;
+        if (last) th->done.notify_all();
         th->tm.unlock();
-        auto st = th->st;
-        for (std::size_t i = 0; i < st.size(); i++) {
-            auto e = st[i];
-            e->Wait();
+        if (!last) return;
+        th = parent;
+    }
+}
+
+void sol::sched::WorkerLoop(Worker* w) {
+    currentWorker = w;
+    while (true) {
+        if (RunOne(w)) {
+            // A task that parked gave `w` to another thread
+            if (currentWorker != w) return;
+            continue;
         }
-        th->wm.unlock();
-    });
-    threads[th->t.get_id()] = th;
-    SOL_MUNLOCKRET(threads_m, th)
+        std::unique_lock lock(sched_m);
+        sleeping++;
+        sched_cv.wait(lock, [](){
+            return stop || queued.load() != 0;
+        });
+        sleeping--;
+        if (stop && queued.load() == 0) return;
+    }
 }
 
-sol::Thread* sol::Thread::Spawn(voidfn code) {
-    auto res = Thread::New(code);
-    this->st.push_back(res);
-    return res;
+void sol::sched::Park() {
+    Worker* w = currentWorker;
+    if (w == NULL) return;
+    currentWorker = NULL;
+    sched_m.lock();
+    handoffs.push_back(w);
+    // Spares are kept around after the thread that parked finishes, so a new one is only started when none is free
+    if (handoffs.size() > idleSpares) threads.push_back(std::thread(SpareLoop));
+    sched_m.unlock();
+    spare_cv.notify_one();
 }
 
-void sol::Thread::Wait() {
-    this->wm.lock();
-    this->wm.unlock();
+void sol::sched::SpareLoop() {
+    std::unique_lock lock(sched_m);
+    while (true) {
+        idleSpares++;
+        spare_cv.wait(lock, [](){
+            return stop || !handoffs.empty();
+        });
+        idleSpares--;
+        if (handoffs.empty()) return;
+        Worker* w = handoffs.back();
+        handoffs.pop_back();
+        lock.unlock();
+        WorkerLoop(w);
+        lock.lock();
+    }
 }
 
 void sol::InitsManager::AddInitNow(voidfn initer, voidfn deiniter) {
@@ -179,83 +1719,47 @@ void sol::InitsManager::Deinit() {
     SOL_MUNLOCK(m)
 }
 
-std::function<sol::Value()> mkundef;
-std::function<sol::Value()> mknull;
-std::function<sol::Value()> mksym;
-
 void sol::Init() {
     InitsManager* im = new InitsManager;
     GlobalIM.AddInitNow([im](){
         im->AddInitNow(Noop, [](){
-            for (auto i : threads) delete i.second;
-        });
-        im->AddInitNow([](){
-            mkundef = mknew([](){
-                BaseValue* val = new BaseValue;
-                vec8* type = new vec8(cstringToVec8("undefined"));
-                val->Set(cstringToVec8("type"), type);
-                val->Set(cstringToVec8("copy"), new std::function(mkundef));
-                val->Set(cstringToVec8("collect"), mkcollect(val, [val](){
-                    delete val->Get(cstringToVec8("type"));
-                    delete val->Get(cstringToVec8("copy"));
-                    delete val->Get(cstringToVec8("collect"));
-                    delete val;
-                }));
-                return val;
-            });
-            mknull = mknew([](){
-                BaseValue* val = new BaseValue;
-                vec8* type = new vec8(cstringToVec8("null"));
-                val->Set(cstringToVec8("type"), type);
-                val->Set(cstringToVec8("copy"), new std::function(mknull));
-                val->Set(cstringToVec8("collect"), mkcollect(val, [val](){
-                    delete val->Get(cstringToVec8("type"));
-                    delete val->Get(cstringToVec8("copy"));
-                    delete val->Get(cstringToVec8("collect"));
-                    delete val;
-                }));
-                return val;
-            });
-            mpf_init(symnum);
-            mksym = mknew([](){
-                BaseValue* val = new BaseValue;
-                vec8* type = new vec8(cstringToVec8("symbol"));
-                val->Set(cstringToVec8("type"), type);
-                val->Set(cstringToVec8("copy"), new std::function([val](){
-                    auto res = mksym();
-                    mpf_ptr num = new mpf_t;
-                    mpf_init(num);
-                    mpf_set(num, (mpf_ptr)val->Get(cstringToVec8("sym")));
-                    res.CoreSet(cstringToVec8("sym"), num);
-                    return res;
-                }));
-                val->Set(cstringToVec8("collect"), mkcollect(val, [val](){
-                    mpf_clear((mpf_ptr)val->Get(cstringToVec8("sym")));
-                    delete val->Get(cstringToVec8("sym"));
-                    delete val->Get(cstringToVec8("type"));
-                    delete val->Get(cstringToVec8("copy"));
-                    delete val->Get(cstringToVec8("copy"));
-                    delete val;
-                }));
-                return val;
-            });
-        }, [](){
-            sym_m.lock();
-            mpf_clear(symnum);
-            for (auto i : symdescs) {
-                mpf_clear(i.first);
-                delete i.first;
-            }
-            sym_m.unlock();
             gc::gc_m.lock();
-            std::vector<void*> all_c(gc::all.begin(), gc::all.end());
+            gc::StopMarkers();
+            gc::FreeAll();
             gc::gc_m.unlock();
-            for (auto i : all_c) {
-                sol::Value r;
-                r._ = i;
-                r.Collect();
+            registry_m.lock();
+            RegistryTable* table = registry.exchange(NULL, std::memory_order_acq_rel);
+            if (table != NULL) {
+                for (std::size_t i = 0; i < table->capacity; i++) {
+                    RegistryEntry* entry = table->slots[i].load(std::memory_order_relaxed);
+                    if (entry == NULL) continue;
+                    entry->key->Release();
+                    if (entry->data->rc.fetch_sub(1, std::memory_order_acq_rel) == 1) delete entry->data;
+                    delete entry;
+                }
+            }
+            while (table != NULL) {
+                RegistryTable* older = table->older;
+                delete table;
+                table = older;
+            }
+            registry_m.unlock();
+            for (auto& shard : internShards) {
+                shard.m.lock();
+                for (auto i : shard.nodes) i->Release();
+                shard.nodes.clear();
+                shard.m.unlock();
             }
+            shapes_m.lock();
+            rootShape.Clear();
+            shapes_m.unlock();
         });
+#if defined(__linux__)
+        // Stopped after the scheduler, whose loops don't finish while they have operations in flight
+        im->AddInitNow(io::Start, io::Stop);
+#endif
+        // Deiniters run in reverse, so every `Thread` is done before the heap is freed
+        im->AddInitNow(sched::Start, sched::Stop);
         im->AddInitNow([](){
             std::ios_base::sync_with_stdio();
         }, Noop);
@@ -265,359 +1769,1499 @@ void sol::Init() {
     });
 }
 
-void sol::Teardown() {
-    GlobalIM.Deinit();
+void sol::Teardown() {
+    GlobalIM.Deinit();
+}
+
+sol::Thread* sol::SpawnThread(voidfn code) {
+    return currentThread->Spawn(std::move(code));
+}
+
+sol::EventLoop* sol::CurrentEventLoop() {
+    return currentThread->Loop();
+}
+
+#if defined(__linux__)
+void sol::io::Start() {
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    uring = StartUring();
+    if (uring) {
+        wakeOp = new Op;
+        wakeOp->kind = Op::KindWake;
+        wakeOp->fd = wakeFd;
+        wakeOp->buf = &wakeCount;
+        wakeOp->size = sizeof(wakeCount);
+        wakeOp->offset = -1;
+        io_m.lock();
+        QueueSqe(wakeOp);
+        io_m.unlock();
+        poller = std::thread(UringLoop);
+        return;
+    }
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+    poller = std::thread(EpollLoop);
+}
+
+void sol::io::Stop() {
+    stopping = true;
+    Wake();
+    poller.join();
+    stopping = false;
+#if defined(SOL_IO_URING)
+    if (uring) {
+        munmap(sqes, sqesSize);
+        munmap(cqRing, cqRingSize);
+        munmap(sqRing, sqRingSize);
+        close(ringFd);
+        ringFd = -1;
+        unsubmitted = 0;
+        delete wakeOp;
+        wakeOp = NULL;
+    }
+#endif
+    if (!uring) {
+        close(epollFd);
+        epollFd = -1;
+    }
+    close(wakeFd);
+    wakeFd = -1;
+    buffers.clear();
+    buffersRegistered = false;
+}
+
+bool sol::io::StartUring() {
+#if defined(SOL_IO_URING)
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, RingEntries, &p);
+    if (fd < 0) return false;
+    // The plain read and write operations came with reading and writing at the current position, so this covers both
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        return false;
+    }
+    sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = (io_uring_sqe*)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (cqRing != MAP_FAILED) munmap(cqRing, cqRingSize);
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        close(fd);
+        return false;
+    }
+    sqHead = (unsigned*)((char*)sqRing + p.sq_off.head);
+    sqTail = (unsigned*)((char*)sqRing + p.sq_off.tail);
+    sqArray = (unsigned*)((char*)sqRing + p.sq_off.array);
+    sqMask = *(unsigned*)((char*)sqRing + p.sq_off.ring_mask);
+    sqEntries = p.sq_entries;
+    cqHead = (unsigned*)((char*)cqRing + p.cq_off.head);
+    cqTail = (unsigned*)((char*)cqRing + p.cq_off.tail);
+    cqMask = *(unsigned*)((char*)cqRing + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)((char*)cqRing + p.cq_off.cqes);
+    ringFd = fd;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void sol::io::Submit(Op* op) {
+    op->loop->Ref();
+    io_m.lock();
+    bool first;
+#if defined(SOL_IO_URING)
+    if (uring) {
+        QueueSqe(op);
+        first = unsubmitted == 1;
+    }
+#endif
+    if (!uring) {
+        queued.push_back(op);
+        first = queued.size() == 1;
+    }
+    io_m.unlock();
+    // Only the first operation since the poller last woke needs to wake it, it takes the rest along
+    if (first) Wake();
+}
+
+void sol::io::Wake() {
+    uint64_t one = 1;
+    while (write(wakeFd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+}
+
+void sol::io::QueueSqe([[maybe_unused]] Op* op) {
+#if defined(SOL_IO_URING)
+    unsigned tail = *sqTail;
+    while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+        // The ring is full, so submit what's on it now instead of waiting for the poller
+        if (syscall(__NR_io_uring_enter, ringFd, unsubmitted, 0, 0, NULL, 0) >= 0) {
+            unsubmitted = 0;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    unsigned i = tail & sqMask;
+    io_uring_sqe* sqe = &sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->kind == Op::KindWrite ? IORING_OP_WRITE : op->kind == Op::KindReadFixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = op->fd;
+    sqe->addr = (uint64_t)(uintptr_t)op->buf;
+    sqe->len = op->size;
+    sqe->off = (uint64_t)op->offset;
+    sqe->buf_index = op->index;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    sqArray[i] = i;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+#endif
+}
+
+void sol::io::Deliver(Op* op, int64_t res) {
+    EventLoop* loop = op->loop;
+    loop->Post([done = std::move(op->done), res](){
+        done(res);
+    });
+    delete op;
+    // After posting, so the loop can't run out of work in between
+    loop->Unref();
+}
+
+void sol::io::UringLoop() {
+#if defined(SOL_IO_URING)
+    while (true) {
+        io_m.lock();
+        unsigned count = unsubmitted;
+        unsubmitted = 0;
+        io_m.unlock();
+        if (syscall(__NR_io_uring_enter, ringFd, count, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            io_m.lock();
+            unsubmitted += count;
+            io_m.unlock();
+        }
+        bool stop = false;
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            io_uring_cqe* cqe = &cqes[head & cqMask];
+            Op* op = (Op*)(uintptr_t)cqe->user_data;
+            if (op != wakeOp) {
+                Deliver(op, cqe->res);
+                continue;
+            }
+            if (stopping) {
+                stop = true;
+                continue;
+            }
+            io_m.lock();
+            QueueSqe(wakeOp);
+            io_m.unlock();
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        if (stop) return;
+    }
+#endif
+}
+
+void sol::io::EpollLoop() {
+    epoll_event events[64];
+    std::vector<Op*> ops;
+    while (true) {
+        int count = epoll_wait(epollFd, events, 64, -1);
+        bool stop = false;
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd != wakeFd) {
+                Ready(fd, events[i].events);
+                continue;
+            }
+            while (read(wakeFd, &wakeCount, sizeof(wakeCount)) < 0 && errno == EINTR) {}
+            stop = stopping;
+            io_m.lock();
+            ops.swap(queued);
+            io_m.unlock();
+            for (auto op : ops) Begin(op);
+            ops.clear();
+        }
+        if (stop) return;
+    }
+}
+
+void sol::io::Begin(Op* op) {
+    struct stat st;
+    // epoll can't wait on regular files, but reading and writing them doesn't wait for anyone else either
+    if (fstat(op->fd, &st) < 0 || S_ISREG(st.st_mode)) return Deliver(op, Perform(op));
+    // Like io_uring, streams have no position to read or write at
+    op->offset = -1;
+    int flags = fcntl(op->fd, F_GETFL);
+    if (flags >= 0 && !(flags & O_NONBLOCK)) fcntl(op->fd, F_SETFL, flags | O_NONBLOCK);
+    auto it = waiting.find(op->fd);
+    std::deque<Op*>* queue = NULL;
+    if (it != waiting.end()) queue = op->kind == Op::KindWrite ? &it->second.writes : &it->second.reads;
+    // Operations in the same direction on the same fd finish in the order they were started
+    if (queue == NULL || queue->empty()) {
+        int64_t res = Perform(op);
+        if (res != -EAGAIN) return Deliver(op, res);
+    }
+    Waiting& w = waiting[op->fd];
+    (op->kind == Op::KindWrite ? w.writes : w.reads).push_back(op);
+    Update(op->fd);
+}
+
+int64_t sol::io::Perform(Op* op) {
+    ssize_t res;
+    do {
+        if (op->kind == Op::KindWrite) {
+            res = op->offset == -1 ? write(op->fd, op->buf, op->size) : pwrite(op->fd, op->buf, op->size, op->offset);
+        } else {
+            res = op->offset == -1 ? read(op->fd, op->buf, op->size) : pread(op->fd, op->buf, op->size, op->offset);
+        }
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+    return res;
+}
+
+void sol::io::Ready(int fd, uint32_t events) {
+    auto it = waiting.find(fd);
+    if (it == waiting.end()) return;
+    Waiting& w = it->second;
+    uint32_t failed = EPOLLERR | EPOLLHUP;
+    for (auto queue : {&w.reads, &w.writes}) {
+        if (!(events & ((queue == &w.reads ? EPOLLIN : EPOLLOUT) | failed))) continue;
+        while (!queue->empty()) {
+            int64_t res = Perform(queue->front());
+            if (res == -EAGAIN) break;
+            Deliver(queue->front(), res);
+            queue->pop_front();
+        }
+    }
+    Update(fd);
+}
+
+void sol::io::Update(int fd) {
+    Waiting& w = waiting[fd];
+    uint32_t events = (w.reads.empty() ? 0 : (uint32_t)EPOLLIN) | (w.writes.empty() ? 0 : (uint32_t)EPOLLOUT);
+    if (events == w.events) {
+        if (events == 0) waiting.erase(fd);
+        return;
+    }
+    epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    int op = events == 0 ? EPOLL_CTL_DEL : w.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(epollFd, op, fd, &ev) == 0) {
+        w.events = events;
+        if (events == 0) waiting.erase(fd);
+        return;
+    }
+    // An fd epoll won't take can't be waited on, so what's waiting on it fails
+    int64_t res = -errno;
+    for (auto i : w.reads) Deliver(i, res);
+    for (auto i : w.writes) Deliver(i, res);
+    if (w.events != 0) epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, &ev);
+    waiting.erase(fd);
+}
+
+void sol::io::Read(int fd, void* buf, std::size_t size, int64_t offset, Callback done) {
+    Op* op = new Op;
+    op->kind = Op::KindRead;
+    op->fd = fd;
+    op->buf = buf;
+    // What one read or write can move at most on Linux
+    op->size = std::min<std::size_t>(size, 0x7FFFF000);
+    op->offset = offset;
+    op->done = std::move(done);
+    op->loop = CurrentEventLoop();
+    Submit(op);
+}
+
+void sol::io::Write(int fd, const void* buf, std::size_t size, int64_t offset, Callback done) {
+    Op* op = new Op;
+    op->kind = Op::KindWrite;
+    op->fd = fd;
+    op->buf = (void*)buf;
+    op->size = std::min<std::size_t>(size, 0x7FFFF000);
+    op->offset = offset;
+    op->done = std::move(done);
+    op->loop = CurrentEventLoop();
+    Submit(op);
+}
+
+bool sol::io::RegisterBuffers(std::vector<Buffer> bufs) {
+    io_m.lock();
+    buffers = std::move(bufs);
+    buffersRegistered = false;
+#if defined(SOL_IO_URING)
+    if (uring) {
+        syscall(__NR_io_uring_register, ringFd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        std::vector<iovec> iovs;
+        for (auto& i : buffers) iovs.push_back({i.data, i.size});
+        buffersRegistered = !iovs.empty() && syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iovs.data(), iovs.size()) == 0;
+    }
+#endif
+    SOL_MUNLOCKRET(io_m, buffersRegistered)
+}
+
+void sol::io::ReadFixed(int fd, std::size_t index, int64_t offset, Callback done) {
+    io_m.lock();
+    if (index >= buffers.size()) {
+        io_m.unlock();
+        CurrentEventLoop()->Post([done = std::move(done)](){
+            done(-EINVAL);
+        });
+        return;
+    }
+    Op* op = new Op;
+    // Buffers the kernel didn't take are read into like any other
+    op->kind = buffersRegistered ? Op::KindReadFixed : Op::KindRead;
+    op->buf = buffers[index].data;
+    op->size = std::min<std::size_t>(buffers[index].size, 0x7FFFF000);
+    op->index = index;
+    io_m.unlock();
+    op->fd = fd;
+    op->offset = offset;
+    op->done = std::move(done);
+    op->loop = CurrentEventLoop();
+    Submit(op);
+}
+
+bool sol::io::UsingIoUring() {
+    return uring;
+}
+#endif
+
+sol::vec8 sol::cstringToVec8(char* cstr) {
+    std::vector<uint8_t> res;
+    for (size_t i = 0; true; i++) {
+        if (cstr[i] == '\0') break;
+        res.push_back(cstr[i]);
+    }
+    return res;
+}
+
+std::string sol::vec8ToStdString(vec8 v) {
+    std::string result;
+    for (auto i : v) {
+        result.push_back(i);
+    }
+    return result;
+}
+
+sol::Atom sol::Intern(vec8 key) {
+    atoms_m.lock();
+    Atom res = &*atoms.insert(key).first;
+    SOL_MUNLOCKRET(atoms_m, res)
+}
+
+sol::Atom sol::FindAtom(vec8 key) {
+    atoms_m.lock();
+    auto it = atoms.find(key);
+    Atom res = it == atoms.end() ? NULL : &*it;
+    SOL_MUNLOCKRET(atoms_m, res)
+}
+
+sol::Value sol::Value::NewUndefined() {
+    Value res;
+    res._ = tag::Undefined;
+    return res;
+}
+
+sol::Value sol::Value::Copy() {
+    if (!IsBase(*this)) return *this;
+    BaseValue* val = ToBase(*this);
+    return kindOps[val->kind].copy(val);
+}
+
+void sol::Value::Collect() {
+    if (!IsBase(*this)) return;
+    mkcollect(ToBase(*this));
+}
+
+sol::Value sol::Value::NewNull() {
+    Value res;
+    res._ = tag::Null;
+    return res;
+}
+
+sol::Value sol::Value::NewBoolean(bool val) {
+    Value res;
+    res._ = tag::Bool | (val ? 1 : 0);
+    return res;
+}
+
+sol::Value sol::Value::NewNumber(double val) {
+    Value res;
+    if (val >= INT32_MIN && val <= INT32_MAX && (double)(int32_t)val == val && !(val == 0 && std::signbit(val))) {
+        res._ = tag::Int | (uint32_t)(int32_t)val;
+        return res;
+    }
+    if (std::isnan(val)) {
+        res._ = tag::NaN;
+        return res;
+    }
+    std::memcpy(&res._, &val, sizeof(double));
+    return res;
+}
+
+void sol::Value::MakeNotPersistent() {
+    if (!IsBase(*this)) return;
+    ToBase(*this)->roots.fetch_and(~gc::PersistentBit);
+}
+
+void sol::Value::MakePersistent() {
+    if (!IsBase(*this)) return;
+    BaseValue* val = ToBase(*this);
+    if (val->roots.fetch_or(gc::PersistentBit) == 0) gc::Rooted(val);
+}
+
+sol::Persistent sol::Persistent::New(Value val) {
+    Persistent res;
+    res.val = val;
+    if (!IsBase(val)) return res;
+    if (ToBase(val)->roots.fetch_add(1) == 0) gc::Rooted(ToBase(val));
+    return res;
+}
+
+sol::Value sol::Persistent::Get() {
+    return val;
+}
+
+void sol::Persistent::Dispose() {
+    if (!IsBase(val)) return;
+    ToBase(val)->roots.fetch_sub(1);
+}
+
+sol::HandleScope::HandleScope() {
+    gc::Handles* h = gc::CurrentHandles();
+    handles = h;
+    start = h->count.load(std::memory_order_relaxed);
+    h->depth++;
+}
+
+sol::HandleScope::~HandleScope() {
+    gc::Handles* h = (gc::Handles*)handles;
+    h->count.store(start, std::memory_order_release);
+    h->depth--;
+}
+
+void sol::Value::AddReference(Value val) {
+    if (!IsBase(*this) || !IsBase(val)) return;
+    gc::gc_m.lock();
+    BaseValue* from = ToBase(*this);
+    BaseValue* to = ToBase(val);
+    to->incoming++;
+    from->refs.push_back(to);
+    if (from->old && !to->old) gc::Remember(from);
+    // A marked value must never point at an unmarked one while marking, or the unmarked one would be swept
+    if (gc::phase == gc::PhaseMarking && from->marked) gc::Shade(to);
+    SOL_MUNLOCK(gc::gc_m)
+}
+
+void sol::Value::RemoveReference(Value val) {
+    if (!IsBase(*this) || !IsBase(val)) return;
+    gc::gc_m.lock();
+    auto& refs = ToBase(*this)->refs;
+    auto it = std::find(refs.begin(), refs.end(), ToBase(val));
+    if (it != refs.end()) {
+        *it = refs.back();
+        refs.pop_back();
+        ToBase(val)->incoming--;
+    }
+    SOL_MUNLOCK(gc::gc_m)
+}
+
+void sol::SetGCMarkerThreads(std::size_t count) {
+    gc::gc_m.lock();
+    gc::markers = std::max((std::size_t)1, count);
+    SOL_MUNLOCK(gc::gc_m)
 }
 
-sol::Thread* sol::SpawnThread(voidfn code) {
-    threads_m.lock();
-    Thread* t = threads[std::this_thread::get_id()];
-    SOL_MUNLOCKRET(threads_m, t->Spawn(code))
+void sol::SetGCIncremental(bool incremental) {
+    gc::gc_m.lock();
+    gc::incremental = incremental;
+    SOL_MUNLOCK(gc::gc_m)
 }
 
-sol::vec8 sol::cstringToVec8(char* cstr) {
-    std::vector<uint8_t> res;
-    for (size_t i = 0; true; i++) {
-        if (cstr[i] == '\0') break;
-        res.push_back(cstr[i]);
-    }
-    return res;
+bool sol::GCIdleStep(std::chrono::microseconds budget) {
+    gc::gc_m.lock();
+    gc::Budget b;
+    b.deadline = std::chrono::steady_clock::now() + budget;
+    // Idle time is a good moment to start a cycle early, before allocation would force one
+    if (gc::phase == gc::PhaseIdle && gc::all.size() >= gc::threshold / 2) gc::StartCycle();
+    bool res = gc::phase != gc::PhaseIdle && !gc::Step(b);
+    SOL_MUNLOCKRET(gc::gc_m, res)
 }
 
-std::string sol::vec8ToStdString(vec8 v) {
-    std::string result;
-    for (auto i : v) {
-        result.push_back(i);
+void sol::CollectGarbage() {
+    gc::gc_m.lock();
+    gc::Collect();
+    gc::gc_m.unlock();
+    EvictInternedStrings();
+}
+
+namespace sol {
+    namespace utf {
+        // Widens the ASCII bytes at the start of `in` into `out`, a whole vector at a time, and returns how many there were
+        std::size_t WidenAscii(const uint8_t* in, std::size_t size, uint16_t* out);
+        // Returns how many bytes at the start of `in` are ASCII, checking a whole vector at a time
+        std::size_t AsciiPrefix(const uint8_t* in, std::size_t size);
+        // Returns how many bytes in `in` aren't ASCII
+        std::size_t CountNonAscii(const uint8_t* in, std::size_t size);
+        // Narrows the code units at the start of `in` that have none of the `high` bits set into `out`, a whole vector at a time, and returns how many there were
+        std::size_t Narrow(const uint16_t* in, std::size_t size, uint8_t* out, uint16_t high);
+        enum DecodeResult {
+            DecodeOk,
+            DecodeInvalid,
+            DecodeTruncated
+        };
+        // Decodes the UTF-8 sequence at `in[i]` into `codepoint` and moves `i` past it. Invalid sequences are skipped up to the byte that made them invalid
+        DecodeResult Decode(const uint8_t* in, std::size_t size, std::size_t& i, uint32_t& codepoint);
+        // Decodes `in` onto the end of `out`, which stays one byte per code unit while it can. Returns how many bytes it used, which stops short of a sequence cut off by the end of `in` if `partial` is set
+        std::size_t DecodeAppend(const uint8_t* in, std::size_t size, BaseString& out, bool partial);
+        // Adds the UTF-8 length of the code units at the start of `in` to `bytes`, a vector at a time, stopping before the first vector with a surrogate. Returns how many code units it went through
+        std::size_t CountNoSurrogates(const uint16_t* in, std::size_t size, std::size_t& bytes);
     }
-    return result;
 }
 
-sol::Value sol::Value::NewUndefined() {
-    return mkundef();
+std::size_t sol::BaseString::Size() const {
+    return oneByte ? bytes.size() : chars.size();
 }
 
-sol::Value sol::Value::Copy() {
-    BaseValue* val = (BaseValue*)_;
-    std::function<Value()>* fnptr = (std::function<Value()>*)val->Get(cstringToVec8("copy"));
-    return (*fnptr)();
+uint16_t sol::BaseString::At(std::size_t i) const {
+    return oneByte ? bytes[i] : chars[i];
 }
 
-void sol::Value::Collect() {
-    auto fnptr = (voidfn*)(((BaseValue*)_)->Get(cstringToVec8("collect")));
-    (*fnptr)();
+void sol::BaseString::Widen() {
+    if (!oneByte) return;
+    chars.resize(bytes.size());
+    std::copy(bytes.begin(), bytes.end(), chars.begin());
+    bytes = vec8();
+    oneByte = false;
 }
 
-sol::Value sol::Value::NewNull() {
-    return mknull();
+void sol::BaseString::Compact() {
+    if (oneByte) return;
+    vec8 narrow(chars.size());
+    if (utf::Narrow(chars.data(), chars.size(), narrow.data(), 0xFF00) != chars.size()) return;
+    bytes = std::move(narrow);
+    chars = vec16();
+    litchars.clear();
+    oneByte = true;
 }
 
-void sol::Value::MakeNotPersistent() {
-    gc::gc_m.lock();
+std::size_t sol::utf::WidenAscii(const uint8_t* in, std::size_t size, uint16_t* out) {
     std::size_t i = 0;
-    bool persistent = false;
-    while (i < gc::persistent.size()) {
-        if (gc::persistent[i] == _) {
-            persistent = true;
-            break;
+#if defined(__AVX2__)
+    for (; i + 32 <= size; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(in + i));
+        uint32_t high = _mm256_movemask_epi8(bytes);
+        if (high != 0) {
+            i += __builtin_ctz(high);
+            for (std::size_t j = i & ~(std::size_t)31; j < i; j++) out[j] = in[j];
+            return i;
         }
-        i++;
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes)));
+        _mm256_storeu_si256((__m256i*)(out + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1)));
     }
-    if (persistent) gc::persistent.erase(gc::persistent.begin() + i);
-    SOL_MUNLOCK(gc::gc_m)
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(in + i));
+        uint32_t high = _mm_movemask_epi8(bytes);
+        if (high != 0) {
+            i += __builtin_ctz(high);
+            for (std::size_t j = i & ~(std::size_t)15; j < i; j++) out[j] = in[j];
+            return i;
+        }
+        _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi8(bytes, zero));
+        _mm_storeu_si128((__m128i*)(out + i + 8), _mm_unpackhi_epi8(bytes, zero));
+    }
+#else
+    for (; i + 8 <= size; i += 8) {
+        uint64_t bytes;
+        memcpy(&bytes, in + i, 8);
+        if ((bytes & 0x8080808080808080) != 0) break;
+        for (std::size_t j = 0; j < 8; j++) out[i + j] = in[i + j];
+    }
+#endif
+    for (; i < size && in[i] < 0x80; i++) out[i] = in[i];
+    return i;
 }
 
-void sol::Value::MakePersistent() {
-    gc::gc_m.lock();
-    bool persistent = false;
-    for (auto i : gc::persistent) {
-        if (i == _) {
-            persistent = true;
-            break;
-        }
+std::size_t sol::utf::AsciiPrefix(const uint8_t* in, std::size_t size) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= size; i += 32) {
+        uint32_t high = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(in + i)));
+        if (high != 0) return i + __builtin_ctz(high);
     }
-    if (!persistent) gc::persistent.push_back(_);
-    SOL_MUNLOCK(gc::gc_m)
+#elif defined(__SSE2__)
+    for (; i + 16 <= size; i += 16) {
+        uint32_t high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(in + i)));
+        if (high != 0) return i + __builtin_ctz(high);
+    }
+#else
+    for (; i + 8 <= size; i += 8) {
+        uint64_t bytes;
+        memcpy(&bytes, in + i, 8);
+        if ((bytes & 0x8080808080808080) != 0) break;
+    }
+#endif
+    for (; i < size && in[i] < 0x80; i++);
+    return i;
 }
 
-sol::BaseString sol::utf8ToString(vec8 val) {
-    std::vector<uint32_t> codepoints;
+std::size_t sol::utf::CountNonAscii(const uint8_t* in, std::size_t size) {
     std::size_t i = 0;
-    while (i < val.size()) {
-        uint8_t curr = val[i];
-        if (((curr & 0b10000000) >> 7) == 0) {
-            codepoints.push_back(curr);
-            i++;
-            continue;
-        }
-        if (((curr & 0b01000000) >> 6) == 0) {
-            i++;
-            continue;
+    std::size_t count = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= size; i += 16) count += __builtin_popcount(_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(in + i))));
+#endif
+    for (; i < size; i++) count += in[i] >> 7;
+    return count;
+}
+
+sol::utf::DecodeResult sol::utf::Decode(const uint8_t* in, std::size_t size, std::size_t& i, uint32_t& codepoint) {
+    uint8_t curr = in[i];
+    std::size_t length;
+    if (curr < 0x80) {
+        codepoint = curr;
+        i++;
+        return DecodeOk;
+    } else if (curr >= 0xC2 && curr <= 0xDF) {
+        codepoint = curr & 0b00011111;
+        length = 2;
+    } else if (curr >= 0xE0 && curr <= 0xEF) {
+        codepoint = curr & 0b00001111;
+        length = 3;
+    } else if (curr >= 0xF0 && curr <= 0xF4) {
+        codepoint = curr & 0b00000111;
+        length = 4;
+    } else {
+        // A stray continuation byte or a lead byte that can only start an overlong or too big sequence
+        i++;
+        return DecodeInvalid;
+    }
+    for (std::size_t j = 1; j < length; j++) {
+        if (i + j >= size) {
+            i += j;
+            return DecodeTruncated;
         }
-        if (((curr & 0b00100000) >> 5) == 0) {
-            uint8_t part1 = (curr & 0b00011111);
-            i++;
-            if (i >= val.size()) break;
-            curr = val[i];
-            if ((((curr & 0b1000000) >> 7) == 0) || (((curr & 0b01000000) >> 6) == 1)) {
-                continue;
-            }
-            uint8_t part2 = (curr & 0b00111111);
-            codepoints.push_back((part1 << 6) + part2);
-            i++;
-            continue;
+        if ((in[i + j] & 0b11000000) != 0b10000000) {
+            i += j;
+            return DecodeInvalid;
         }
-        if (((curr & 0b00010000) >> 4) == 0) {
-            uint8_t part1 = (curr & 0b00001111);
-            i++;
-            if (i >= val.size()) break;
-            curr = val[i];
-            if ((((curr & 0b10000000) >> 7) == 0) || (((curr & 0b01000000) >> 6) == 1)) {
-                continue;
+        codepoint = (codepoint << 6) | (in[i + j] & 0b00111111);
+    }
+    i += length;
+    if ((length == 3 && codepoint < 0x800) || (length == 4 && (codepoint < 0x10000 || codepoint > 0x10FFFF))) return DecodeInvalid;
+    return DecodeOk;
+}
+
+std::size_t sol::utf::DecodeAppend(const uint8_t* in, std::size_t size, BaseString& out, bool partial) {
+    std::size_t i = 0;
+    std::size_t o;
+    uint32_t codepoint;
+    // Whether decoding stopped at a sequence cut off by the end of `in`
+    bool cut = false;
+    if (out.Size() == 0) {
+        out.chars.clear();
+        out.litchars.clear();
+        out.oneByte = true;
+    }
+    if (out.oneByte) {
+        o = out.bytes.size();
+        out.bytes.resize(o + size);
+        uint8_t* narrow = out.bytes.data();
+        while (i < size) {
+            std::size_t ascii = AsciiPrefix(in + i, size - i);
+            memcpy(narrow + o, in + i, ascii);
+            i += ascii;
+            o += ascii;
+            if (i >= size) break;
+            std::size_t start = i;
+            DecodeResult res = Decode(in, size, i, codepoint);
+            if (res == DecodeTruncated && partial) {
+                i = start;
+                cut = true;
+                break;
             }
-            uint8_t part2 = (curr & 0b00111111);
-            i++;
-            if (i >= val.size()) break;
-            curr = val[i];
-            if ((((curr & 0b10000000) >> 7) == 0) || (((curr & 0b01000000) >> 6) == 1)) {
+            if (res != DecodeOk) continue;
+            if (codepoint <= 0xFF) {
+                narrow[o++] = codepoint;
                 continue;
             }
-            uint8_t part3 = (curr & 0b00111111);
-            codepoints.push_back((part1 << 12) + (part2 << 6) + part3);
-            i++;
-            continue;
+            // The output stays one byte per code unit until a code point that doesn't fit shows up
+            i = start;
+            break;
         }
-        if (((curr & 0b00001000) >> 3) == 0) {
-            uint8_t part1 = (curr & 0b00000111);
-            i++;
-            if (i >= val.size()) break;
-            curr = val[i];
-            if ((((curr & 0b10000000) >> 7) == 0) || (((curr & 0b01000000) >> 6) == 1)) {
-                continue;
-            }
-            uint8_t part2 = (curr & 0b00111111);
-            i++;
-            if (i >= val.size()) break;
-            curr = val[i];
-            if ((((curr & 0b10000000) >> 7) == 0) || (((curr & 0b01000000) >> 6) == 1)) {
-                continue;
-            }
-            uint8_t part3 = (curr & 0b00111111);
-            i++;
-            if (i >= val.size()) break;
-            curr = val[i];
-            if ((((curr & 0b10000000) >> 7) == 0) || (((curr & 0b01000000) >> 6) == 1)) {
-                continue;
-            }
-            uint8_t part4 = (curr & 0b00111111);
-            codepoints.push_back((part1 << 18) + (part2 << 12) + (part3 << 6) + part4);
-            i++;
-            continue;
+        if (i >= size || cut) {
+            out.bytes.resize(o);
+            return i;
         }
-        i++;
+        // Every code unit takes at least one byte, so this is always enough
+        out.chars.resize(o + size - i);
+        std::copy(narrow, narrow + o, out.chars.begin());
+        out.bytes = vec8();
+        out.oneByte = false;
+    } else {
+        o = out.chars.size();
+        out.chars.resize(o + size);
     }
-    BaseString result;
-    for (auto i : codepoints) {
-        if (i >= 0xD800 && i <= 0xDFFF) {
-            result.chars.push_back(i);
-            result.litchars.push_back(result.chars.size() - 1);
+    uint16_t* wide = out.chars.data();
+    while (i < size) {
+        std::size_t ascii = WidenAscii(in + i, size - i, wide + o);
+        i += ascii;
+        o += ascii;
+        if (i >= size) break;
+        std::size_t start = i;
+        DecodeResult res = Decode(in, size, i, codepoint);
+        if (res == DecodeTruncated && partial) {
+            i = start;
+            break;
+        }
+        if (res != DecodeOk) continue;
+        if (codepoint >= 0xD800 && codepoint <= 0xDFFF) {
+            if (out.litchars.size() < out.chars.size()) out.litchars.resize(out.chars.size());
+            out.litchars[o] = true;
+            wide[o++] = codepoint;
             continue;
         }
-        if (i >= 0x10000) {
-            uint32_t x = i - 0x10000;
-            uint16_t h = floor(x / 0x400) + 0xD800;
-            uint16_t l = (x % 0x400) + 0xDC00;
-            result.chars.push_back(h);
-            result.chars.push_back(l);
+        if (codepoint >= 0x10000) {
+            codepoint -= 0x10000;
+            wide[o++] = (codepoint >> 10) + 0xD800;
+            wide[o++] = (codepoint & 0x3FF) + 0xDC00;
             continue;
         }
-        result.chars.push_back(i);
+        wide[o++] = codepoint;
     }
+    out.chars.resize(o);
+    if (out.litchars.size() > o) out.litchars.resize(o);
+    return i;
+}
+
+sol::BaseString sol::utf8ToString(vec8 val) {
+    BaseString result;
+    utf::DecodeAppend(val.data(), val.size(), result, false);
     return result;
 }
 
-sol::vec8 sol::stringToUtf8(BaseString val) {
-    std::vector<uint32_t> codepoints;
+void sol::Utf8Decoder::Decode(const uint8_t* data, std::size_t size, BaseString& out) {
     std::size_t i = 0;
-    std::function<bool(std::size_t)> includes = [&val](std::size_t index){
-        for (auto i : val.litchars) {
-            if (i == index) return true;
+    if (pendingSize > 0) {
+        // Finishes the sequence the last chunk cut off. It needs at most 3 more bytes
+        uint8_t joined[7];
+        memcpy(joined, pending, pendingSize);
+        std::size_t extra = std::min(size, (std::size_t)3);
+        memcpy(joined + pendingSize, data, extra);
+        std::size_t used = utf::DecodeAppend(joined, pendingSize + extra, out, true);
+        if (used == 0) {
+            // Still cut off, only possible if this chunk was too short to finish it
+            memcpy(pending + pendingSize, data, extra);
+            pendingSize += extra;
+            return;
         }
-        return false;
-    };
-    while (i < val.chars.size()) {
-        uint16_t curr = val.chars[i];
-        if (curr >= 0xD800 && curr <= 0xDFFF) {
-            if (includes(i)) {
-                codepoints.push_back(curr);
-                i++;
-                continue;
-            }
-            if (!(curr >= 0xD800 && curr <= 0xDBFF)) {
-                i++;
-                continue;
-            }
-            uint16_t h = curr;
+        i = used - pendingSize;
+        pendingSize = 0;
+    }
+    i += utf::DecodeAppend(data + i, size - i, out, true);
+    pendingSize = size - i;
+    memcpy(pending, data + i, pendingSize);
+}
+
+sol::Maybe<sol::Value> sol::Utf8Decoder::DecodeAppend(Value str, const uint8_t* data, std::size_t size) {
+    if (!str.IsString()) return Maybe<Value>::FromError(ErrorWrongType);
+    BaseString chunk;
+    Decode(data, size, chunk);
+    Value val = Value::NewString(std::move(chunk));
+    Maybe<Value> res = str.StringConcat(val);
+    val.Collect();
+    return res;
+}
+
+bool sol::Utf8Decoder::Finish() {
+    bool res = pendingSize > 0;
+    pendingSize = 0;
+    return res;
+}
+
+std::size_t sol::utf::Narrow(const uint16_t* in, std::size_t size, uint8_t* out, uint16_t high) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    __m256i highBits = _mm256_set1_epi16((short)high);
+    for (; i + 16 <= size; i += 16) {
+        __m256i units = _mm256_loadu_si256((const __m256i*)(in + i));
+        if (!_mm256_testz_si256(units, highBits)) break;
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(units, units), 0b11011000);
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(bytes));
+    }
+#elif defined(__SSE2__)
+    __m128i highBits = _mm_set1_epi16((short)high);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= size; i += 8) {
+        __m128i units = _mm_loadu_si128((const __m128i*)(in + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, highBits), zero)) != 0xFFFF) break;
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(units, units));
+    }
+#endif
+    for (; i < size && (in[i] & high) == 0; i++) out[i] = in[i];
+    return i;
+}
+
+std::size_t sol::utf::CountNoSurrogates(const uint16_t* in, std::size_t size, std::size_t& bytes) {
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i twoBytes = _mm_set1_epi16((short)0xFF80);
+    __m128i threeBytes = _mm_set1_epi16((short)0xF800);
+    __m128i surrogate = _mm_set1_epi16((short)0xD800);
+    for (; i + 8 <= size; i += 8) {
+        __m128i units = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i top = _mm_and_si128(units, threeBytes);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(top, surrogate)) != 0) break;
+        // Each mask has two bits per code unit that doesn't need the extra byte
+        uint32_t one = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, twoBytes), zero));
+        uint32_t two = _mm_movemask_epi8(_mm_cmpeq_epi16(top, zero));
+        bytes += 24 - (__builtin_popcount(one) + __builtin_popcount(two)) / 2;
+    }
+#endif
+    return i;
+}
+
+sol::vec8 sol::stringToUtf8(BaseString val) {
+    if (val.oneByte) {
+        const uint8_t* in = val.bytes.data();
+        std::size_t size = val.bytes.size();
+        vec8 result(size + utf::CountNonAscii(in, size));
+        uint8_t* out = result.data();
+        std::size_t i = 0;
+        std::size_t o = 0;
+        while (i < size) {
+            std::size_t ascii = utf::AsciiPrefix(in + i, size - i);
+            memcpy(out + o, in + i, ascii);
+            i += ascii;
+            o += ascii;
+            if (i >= size) break;
+            out[o++] = (in[i] >> 6) | 0b11000000;
+            out[o++] = (in[i] & 0b00111111) | 0b10000000;
             i++;
-            if (i >= val.chars.size()) break;
-            curr = val.chars[i];
-            if (!(curr >= 0xDC00 && curr <= 0xDFFF)) {
-                continue;
-            }
-            uint16_t l = curr;
-            codepoints.push_back(((h - 0xD800) * 0x400) + (l - 0xDC00) + 0x10000);
         }
-        codepoints.push_back(curr);
+        return result;
+    }
+    const uint16_t* in = val.chars.data();
+    std::size_t size = val.chars.size();
+    // Whether the code units at `i` and `i + 1` make a surrogate pair, units in `litchars` always stand on their own
+    auto pairs = [&val, in, size](std::size_t i) {
+        if (!(in[i] >= 0xD800 && in[i] <= 0xDBFF) || i + 1 >= size || !(in[i + 1] >= 0xDC00 && in[i + 1] <= 0xDFFF)) return false;
+        std::size_t lits = val.litchars.size();
+        return !(i < lits && val.litchars[i]) && !(i + 1 < lits && val.litchars[i + 1]);
+    };
+    std::size_t length = 0;
+    std::size_t i = 0;
+    while (i < size) {
+        i += utf::CountNoSurrogates(in + i, size - i, length);
+        if (i >= size) break;
+        uint16_t curr = in[i];
+        if (curr < 0x80) length += 1;
+        else if (curr < 0x800) length += 2;
+        else if (pairs(i)) {
+            length += 4;
+            i++;
+        } else length += 3;
         i++;
     }
-    vec8 result;
-    for (auto i : codepoints) {
-        if (i <= 0x7F) {
-            result.push_back(i);
+    vec8 result(length);
+    uint8_t* out = result.data();
+    std::size_t o = 0;
+    i = 0;
+    while (i < size) {
+        std::size_t ascii = utf::Narrow(in + i, size - i, out + o, 0xFF80);
+        i += ascii;
+        o += ascii;
+        if (i >= size) break;
+        uint32_t curr = in[i];
+        if (curr < 0x800) {
+            out[o++] = (curr >> 6) | 0b11000000;
+            out[o++] = (curr & 0b00111111) | 0b10000000;
+            i++;
             continue;
         }
-        if (i <= 0x7FF) {
-            result.push_back((i >> 6) + 0b11000000);
-            result.push_back((i & 0b00000111111) + 0b10000000);
+        if (pairs(i)) {
+            curr = ((curr - 0xD800) << 10) + (in[i + 1] - 0xDC00) + 0x10000;
+            out[o++] = (curr >> 18) | 0b11110000;
+            out[o++] = ((curr >> 12) & 0b00111111) | 0b10000000;
+            out[o++] = ((curr >> 6) & 0b00111111) | 0b10000000;
+            out[o++] = (curr & 0b00111111) | 0b10000000;
+            i += 2;
             continue;
         }
-        if (i <= 0xFFFF) {
-            result.push_back((i >> 12) + 0b11100000);
-            result.push_back(((i >> 6) & 0b0000111111) + 0b10000000);
-            result.push_back((i & 0b0000000000111111) + 0b10000000);
+        // Lone surrogates take three bytes like the rest, so they survive going back through `utf8ToString`
+        out[o++] = (curr >> 12) | 0b11100000;
+        out[o++] = ((curr >> 6) & 0b00111111) | 0b10000000;
+        out[o++] = (curr & 0b00111111) | 0b10000000;
+        i++;
+    }
+    return result;
+}
+
+sol::StringNode* sol::StringNode::NewFlat(BaseString str) {
+    StringNode* res = new StringNode;
+    res->type = TypeFlat;
+    res->SetFlat(std::move(str));
+    return res;
+}
+
+void sol::StringNode::SetFlat(BaseString str) {
+    flat = std::move(str);
+    flat.Compact();
+    oneByte = flat.oneByte;
+    length = flat.Size();
+    bytes = oneByte ? flat.bytes.data() : NULL;
+    chars = oneByte ? NULL : flat.chars.data();
+    hash.store(0, std::memory_order_relaxed);
+}
+
+sol::StringNode* sol::StringNode::NewExternal(const void* data, std::size_t size, Encoding encoding, voidfn release) {
+    StringNode* res = new StringNode;
+    res->type = TypeExternal;
+    res->external = data;
+    res->externalSize = size;
+    res->release = release;
+    // ASCII UTF-8 reads the same as Latin-1, so it can be indexed directly too
+    if (encoding == EncodingUtf8 && utf::AsciiPrefix((const uint8_t*)data, size) == size) encoding = EncodingLatin1;
+    res->encoding = encoding;
+    if (encoding == EncodingLatin1) {
+        res->bytes = (const uint8_t*)data;
+        res->oneByte = true;
+        res->length = size;
+        return res;
+    }
+    if (encoding == EncodingUtf16) {
+        res->chars = (const uint16_t*)data;
+        res->oneByte = std::all_of(res->chars, res->chars + size, [](uint16_t c) { return c <= 0xFF; });
+        res->length = size;
+        return res;
+    }
+    // Finds the length in UTF-16 code units without decoding into a buffer, decoding only happens if the string is indexed
+    const uint8_t* in = (const uint8_t*)data;
+    std::size_t i = 0;
+    uint32_t codepoint;
+    res->oneByte = true;
+    res->validUtf8 = true;
+    res->length = 0;
+    while (i < size) {
+        std::size_t ascii = utf::AsciiPrefix(in + i, size - i);
+        i += ascii;
+        res->length += ascii;
+        if (i >= size) break;
+        if (utf::Decode(in, size, i, codepoint) != utf::DecodeOk) {
+            res->validUtf8 = false;
             continue;
         }
-        result.push_back((i >> 18) + 0b11110000);
-        result.push_back(((i >> 12) & 0b000111111) + 0b10000000);
-        result.push_back(((i >> 6) & 0b000000000111111) + 0b10000000);
-        result.push_back((i & 0b000000000000000111111) + 0b10000000);
+        res->length += codepoint >= 0x10000 ? 2 : 1;
+        if (codepoint > 0xFF) res->oneByte = false;
     }
-    return result;
+    return res;
 }
 
-sol::Value sol::Value::NewString(BaseString vall) {
-    return mknew([vall](){
-        BaseValue* val = new BaseValue;
-        vec8* type = new vec8(cstringToVec8("string"));
-        BaseString* bstr = new BaseString;
-        *bstr = vall;
-        val->Set(cstringToVec8("type"), type);
-        val->Set(cstringToVec8("str"), bstr);
-        val->Set(cstringToVec8("copy"), new std::function([val](){
-            return sol::Value::NewString(*((BaseString*)(val->Get(cstringToVec8("str")))));
-        }));
-        val->Set(cstringToVec8("collect"), mkcollect(val, [val](){
-            delete val->Get(cstringToVec8("type"));
-            delete val->Get(cstringToVec8("str"));
-            delete val->Get(cstringToVec8("copy"));
-            delete val->Get(cstringToVec8("collect"));
-            delete val;
-        }));
-        return val;
-    })();
+sol::StringNode* sol::StringNode::Concat(StringNode* left, StringNode* right) {
+    if (left->length == 0) {
+        left->Release();
+        return right;
+    }
+    if (right->length == 0) {
+        right->Release();
+        return left;
+    }
+    // Building a string a piece at a time would otherwise add a level per piece and rebalance every `MaxRopeDepth` pieces
+    if (left->type == TypeCons && left->right->type == TypeFlat && left->right->length + right->length <= RopeExtendLength) {
+        StringNode* rest = left->left;
+        StringNode* leaf = left->right;
+        rest->Retain();
+        leaf->Retain();
+        left->Release();
+        return Concat(rest, Concat(leaf, right));
+    }
+    if (right->type == TypeCons && right->left->type == TypeFlat && left->length + right->left->length <= RopeExtendLength) {
+        StringNode* leaf = right->left;
+        StringNode* rest = right->right;
+        leaf->Retain();
+        rest->Retain();
+        right->Release();
+        return Concat(Concat(left, leaf), rest);
+    }
+    StringNode* res = new StringNode;
+    res->type = TypeCons;
+    res->oneByte = left->oneByte && right->oneByte;
+    res->depth = std::max(left->depth, right->depth) + 1;
+    res->length = left->length + right->length;
+    res->left = left;
+    res->right = right;
+    if (res->length < MinRopeLength || (left->type == TypeFlat && right->Direct() && res->length <= RopeExtendLength)) {
+        StringNode* flat = NewFlat(res->Flatten());
+        res->Release();
+        return flat;
+    }
+    if (res->depth > MaxRopeDepth) return Balance(res);
+    return res;
 }
 
-sol::Value sol::Value::NewSymbol() {
-    sym_m.lock();
-    mpf_ptr sym = new mpf_t;
-    mpf_init_set(sym, symnum);
-    mpf_add_ui(symnum, symnum, 1);
-    sym_m.unlock();
-    auto val = mksym();
-    val.CoreSet(cstringToVec8("sym"), sym);
-    return val;
+sol::StringNode* sol::StringNode::Balance(StringNode* node) {
+    std::vector<StringNode*> leaves;
+    node->Leaves(leaves);
+    node->Release();
+    // Runs of short leaves are merged, so ropes built a piece at a time don't stay as deep piles of tiny leaves
+    std::vector<StringNode*> merged;
+    for (std::size_t i = 0; i < leaves.size();) {
+        std::size_t j = i + 1;
+        std::size_t length = leaves[i]->length;
+        while (j < leaves.size() && length + leaves[j]->length <= RopeLeafLength) length += leaves[j++]->length;
+        if (j == i + 1) {
+            merged.push_back(leaves[i++]);
+            continue;
+        }
+        StringNode* run = leaves[i];
+        for (i++; i < j; i++) {
+            StringNode* pair = new StringNode;
+            pair->type = TypeCons;
+            pair->oneByte = run->oneByte && leaves[i]->oneByte;
+            pair->length = run->length + leaves[i]->length;
+            pair->left = run;
+            pair->right = leaves[i];
+            run = pair;
+        }
+        merged.push_back(NewFlat(run->Flatten()));
+        run->Release();
+    }
+    // Pairs up neighbours until one node is left, which gives a tree `log2(leaves)` deep
+    while (merged.size() > 1) {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < merged.size(); i += 2) {
+            if (i + 1 == merged.size()) {
+                merged[n++] = merged[i];
+                continue;
+            }
+            StringNode* pair = new StringNode;
+            pair->type = TypeCons;
+            pair->oneByte = merged[i]->oneByte && merged[i + 1]->oneByte;
+            pair->depth = std::max(merged[i]->depth, merged[i + 1]->depth) + 1;
+            pair->length = merged[i]->length + merged[i + 1]->length;
+            pair->left = merged[i];
+            pair->right = merged[i + 1];
+            merged[n++] = pair;
+        }
+        merged.resize(n);
+    }
+    return merged[0];
 }
 
-sol::Value sol::Value::NewSymbolWithDescription(BaseString desc) {
-    auto val = sol::Value::NewSymbol();
-    mpf_ptr sym = (mpf_ptr)val.CoreGet(cstringToVec8("sym"));
-    sym_m.lock();
-    for (std::size_t i = 0; i < symdescs.size(); i++) {
-        auto vall = symdescs[i];
-        if (mpf_cmp(vall.first, sym) == 0) {
-            vall.second = desc;
-            symdescs[i] = vall;
-            SOL_MUNLOCKRET(sym_m, val)
-        }
-    }
-    mpf_ptr s = new mpf_t;
-    mpf_init_set(s, sym);
-    symdescs.emplace_back(s, desc);
-    SOL_MUNLOCKRET(sym_m, val)
-}
-
-template<typename T>
-sol::Maybe<T> sol::Maybe<T>::FromNoError(T v) {
-    Maybe<T> res;
-    res.err = ErrorNoError;
-    res.val = v;
+sol::StringNode* sol::StringNode::Slice(StringNode* node, std::size_t start, std::size_t end) {
+    std::size_t length = end - start;
+    if (length == node->length) {
+        node->Retain();
+        return node;
+    }
+    // Slices of slices point at the node that owns the storage, so that's the one whose size decides whether sharing wastes too much
+    if (node->type == TypeSlice) {
+        start += node->offset;
+        end += node->offset;
+        node = node->parent;
+    }
+    if (length < MinSliceLength || length * MaxSliceWaste < node->length) {
+        BaseString str;
+        if (node->bytes != NULL) {
+            str.oneByte = true;
+            str.bytes.assign(node->bytes + start, node->bytes + end);
+        } else str.chars.assign(node->chars + start, node->chars + end);
+        for (std::size_t i = start; i < end; i++) {
+            if (!node->Literal(i)) continue;
+            if (str.litchars.empty()) str.litchars.resize(length);
+            str.litchars[i - start] = true;
+        }
+        return NewFlat(std::move(str));
+    }
+    StringNode* res = new StringNode;
+    res->type = TypeSlice;
+    res->parent = node;
+    node->Retain();
+    res->offset = start;
+    res->length = length;
+    res->oneByte = node->oneByte;
+    if (node->bytes != NULL) res->bytes = node->bytes + start;
+    else res->chars = node->chars + start;
+    return res;
+}
+
+void sol::StringNode::Retain() {
+    rc.fetch_add(1, std::memory_order_relaxed);
+}
+
+void sol::StringNode::Release() {
+    if (rc.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    if (type == TypeCons) {
+        left->Release();
+        right->Release();
+    }
+    if (type == TypeExternal && release) release();
+    if (type == TypeSlice) parent->Release();
+    delete this;
+}
+
+sol::BaseString sol::StringNode::Flatten() {
+    if (type == TypeFlat) return flat;
+    if (type == TypeExternal && encoding == EncodingUtf8) {
+        const uint8_t* in = (const uint8_t*)external;
+        return utf8ToString(vec8(in, in + externalSize));
+    }
+    BaseString res;
+    res.oneByte = oneByte;
+    if (oneByte) res.bytes.resize(length);
+    else res.chars.resize(length);
+    CopyTo(res, 0);
     return res;
 }
 
-template<typename T>
-sol::Maybe<T> sol::Maybe<T>::FromError(Error e) {
-    Maybe<T> res;
-    res.err = e;
+void sol::StringNode::CopyTo(BaseString& out, std::size_t offset) {
+    if (type == TypeCons) {
+        left->CopyTo(out, offset);
+        right->CopyTo(out, offset + left->length);
+        return;
+    }
+    if (!Direct()) {
+        BaseString str = Flatten();
+        StringNode* node = NewFlat(std::move(str));
+        node->CopyTo(out, offset);
+        node->Release();
+        return;
+    }
+    if (out.oneByte) {
+        if (bytes != NULL) memcpy(out.bytes.data() + offset, bytes, length);
+        // Two byte buffers that fit, from UTF-16 externals
+        else std::copy(chars, chars + length, out.bytes.begin() + offset);
+        return;
+    }
+    if (bytes != NULL) {
+        std::copy(bytes, bytes + length, out.chars.begin() + offset);
+        return;
+    }
+    std::copy(chars, chars + length, out.chars.begin() + offset);
+    if ((type == TypeSlice ? parent->flat.litchars : flat.litchars).empty()) return;
+    for (std::size_t i = 0; i < length; i++) {
+        if (!Literal(i)) continue;
+        if (out.litchars.empty()) out.litchars.resize(out.chars.size());
+        out.litchars[offset + i] = true;
+    }
+}
+
+uint64_t sol::StringNode::Hash() {
+    uint64_t res = hash.load(std::memory_order_relaxed);
+    if (res != 0) return res;
+    // FNV-1a over the code units, so one and two byte strings with the same contents hash the same
+    res = 0xCBF29CE484222325;
+    if (bytes != NULL) {
+        for (std::size_t i = 0; i < length; i++) res = (res ^ bytes[i]) * 0x100000001B3;
+    } else {
+        for (std::size_t i = 0; i < length; i++) res = (res ^ chars[i]) * 0x100000001B3;
+    }
+    // 0 means not computed yet
+    if (res == 0) res = 1;
+    hash.store(res, std::memory_order_relaxed);
     return res;
 }
 
-template<typename T>
-bool sol::Maybe<T>::IsError() {
-    return err != ErrorNoError;
+bool sol::StringNode::UnitsEqual(StringNode* other) {
+    if (this == other) return true;
+    if (length != other->length) return false;
+    uint64_t h1 = hash.load(std::memory_order_relaxed);
+    uint64_t h2 = other->hash.load(std::memory_order_relaxed);
+    if (h1 != 0 && h2 != 0 && h1 != h2) return false;
+    if (bytes != NULL && other->bytes != NULL) return memcmp(bytes, other->bytes, length) == 0;
+    if (chars != NULL && other->chars != NULL) return memcmp(chars, other->chars, length * sizeof(uint16_t)) == 0;
+    for (std::size_t i = 0; i < length; i++) {
+        if (At(i) != other->At(i)) return false;
+    }
+    return true;
+}
+
+void sol::StringNode::Leaves(std::vector<StringNode*>& leaves) {
+    if (type == TypeCons) {
+        left->Leaves(leaves);
+        right->Leaves(leaves);
+        return;
+    }
+    Retain();
+    leaves.push_back(this);
 }
 
-template<typename T>
-T sol::Maybe<T>::ToNoError() {
-    return val;
+sol::Value sol::Value::NewString(BaseString val) {
+    return mknew(Make<StringObject>(StringNode::NewFlat(std::move(val))));
 }
 
-bool sol::Value::IsPersistent() {
-    gc::gc_m.lock();
-    for (auto i : gc::persistent) {
-        if (i == _) {
-            SOL_MUNLOCKRET(gc::gc_m, true)
+sol::Value sol::Value::NewExternalString(const void* data, std::size_t size, Encoding encoding, voidfn release) {
+    return mknew(Make<StringObject>(StringNode::NewExternal(data, size, encoding, release)));
+}
+
+sol::Value sol::Value::NewSymbol() {
+    SymbolData* data = new SymbolData;
+    data->id = symbolIds.fetch_add(1, std::memory_order_relaxed);
+    return mknew(Make<SymbolObject>(data));
+}
+
+sol::Value sol::Value::NewSymbolWithDescription(BaseString desc) {
+    SymbolData* data = new SymbolData;
+    data->id = symbolIds.fetch_add(1, std::memory_order_relaxed);
+    data->SetDescription(std::move(desc));
+    return mknew(Make<SymbolObject>(data));
+}
+
+sol::Value sol::Value::SymbolFor(BaseString key) {
+    // Looking up doesn't allocate, the key only gets a node of its own if it's added
+    StringNode probe;
+    probe.type = StringNode::TypeFlat;
+    probe.SetFlat(std::move(key));
+    RegistryTable* table = registry.load(std::memory_order_acquire);
+    RegistryEntry* entry = table != NULL ? table->Find(&probe) : NULL;
+    if (entry == NULL) {
+        registry_m.lock();
+        table = registry.load(std::memory_order_relaxed);
+        entry = table != NULL ? table->Find(&probe) : NULL;
+        if (entry == NULL) {
+            entry = new RegistryEntry;
+            entry->key = InternNode(StringNode::NewFlat(probe.flat));
+            // The registry keeps the reference the symbol starts with
+            entry->data = new SymbolData;
+            entry->data->id = symbolIds.fetch_add(1, std::memory_order_relaxed);
+            entry->data->registryKey = entry->key;
+            entry->data->SetDescription(std::move(probe.flat));
+            if (table == NULL || (table->count + 1) * 2 > table->capacity) {
+                RegistryTable* grown = new RegistryTable(table == NULL ? 16 : table->capacity * 2, table);
+                if (table != NULL) {
+                    for (std::size_t i = 0; i < table->capacity; i++) {
+                        RegistryEntry* old = table->slots[i].load(std::memory_order_relaxed);
+                        if (old != NULL) grown->Insert(old);
+                    }
+                }
+                table = grown;
+                table->Insert(entry);
+                registry.store(table, std::memory_order_release);
+            } else {
+                table->Insert(entry);
+            }
         }
+        registry_m.unlock();
     }
-    SOL_MUNLOCKRET(gc::gc_m, false)
+    entry->data->rc.fetch_add(1, std::memory_order_relaxed);
+    return mknew(Make<SymbolObject>(entry->data));
+}
+
+bool sol::Value::IsPersistent() {
+    if (!IsBase(*this)) return true;
+    return ToBase(*this)->roots.load() != 0;
+}
+
+void sol::Value::MakeShared() {
+    if (!IsBase(*this)) return;
+    ToBase(*this)->shared.store(true, std::memory_order_release);
+}
+
+bool sol::Value::IsShared() {
+    if (!IsBase(*this)) return true;
+    return ToBase(*this)->shared.load(std::memory_order_acquire);
 }
 
 bool sol::Value::IsUndefined() {
-    vec8* type = (vec8*)CoreGet(cstringToVec8("type"));
-    return vec8Compare(*type, cstringToVec8("undefined"));
+    return _ == tag::Undefined;
 }
 
 bool sol::Value::IsNull() {
-    vec8* type = (vec8*)CoreGet(cstringToVec8("type"));
-    return vec8Compare(*type, cstringToVec8("null"));
+    return _ == tag::Null;
 }
 
 bool sol::Value::IsString() {
-    vec8* type = (vec8*)CoreGet(cstringToVec8("type"));
-    return vec8Compare(*type, cstringToVec8("string"));
+    return IsBase(*this) && ToBase(*this)->kind == KindString;
 }
 
 bool sol::Value::IsSymbol() {
-    vec8* type = (vec8*)CoreGet(cstringToVec8("type"));
-    return vec8Compare(*type, cstringToVec8("symbol"));
+    return IsBase(*this) && ToBase(*this)->kind == KindSymbol;
+}
+
+bool sol::Value::IsBoolean() {
+    return (_ & tag::Mask) == tag::Bool;
+}
+
+bool sol::Value::IsNumber() {
+    return (_ & tag::Mask) == tag::Int || _ < tag::Object;
+}
+
+sol::Maybe<bool> sol::Value::BooleanGetValue() {
+    if (!IsBoolean()) return Maybe<bool>::FromError(ErrorWrongType);
+    return Maybe<bool>::FromNoError(_ & 1);
+}
+
+sol::Maybe<double> sol::Value::NumberGetValue() {
+    if ((_ & tag::Mask) == tag::Int) return Maybe<double>::FromNoError((int32_t)(uint32_t)_);
+    if (!IsNumber()) return Maybe<double>::FromError(ErrorWrongType);
+    double res;
+    std::memcpy(&res, &_, sizeof(double));
+    return Maybe<double>::FromNoError(res);
 }
 
 sol::Maybe<sol::BaseString> sol::Value::StringGetValue() {
     if (!IsString()) return Maybe<BaseString>::FromError(ErrorWrongType);
-    return Maybe<BaseString>::FromNoError(*((BaseString*)(CoreGet(cstringToVec8("str")))));
+    StringNode* node = ((StringObject*)ToBase(*this))->LoadFlat();
+    Maybe<BaseString> res = Maybe<BaseString>::FromNoError(node->Flatten());
+    node->Release();
+    return res;
+}
+
+sol::Maybe<std::size_t> sol::Value::StringGetLength() {
+    if (!IsString()) return Maybe<std::size_t>::FromError(ErrorWrongType);
+    StringNode* node = ((StringObject*)ToBase(*this))->Load();
+    Maybe<std::size_t> res = Maybe<std::size_t>::FromNoError(node->length);
+    node->Release();
+    return res;
+}
+
+sol::Maybe<uint16_t> sol::Value::StringGetCharAt(std::size_t i) {
+    if (!IsString()) return Maybe<uint16_t>::FromError(ErrorWrongType);
+    StringNode* node = ((StringObject*)ToBase(*this))->LoadFlat();
+    Maybe<uint16_t> res = i < node->length ? Maybe<uint16_t>::FromNoError(node->At(i)) : Maybe<uint16_t>::FromError(ErrorNotFound);
+    node->Release();
+    return res;
+}
+
+sol::Maybe<uint64_t> sol::Value::StringGetHash() {
+    if (!IsString()) return Maybe<uint64_t>::FromError(ErrorWrongType);
+    StringNode* node = ((StringObject*)ToBase(*this))->LoadFlat();
+    Maybe<uint64_t> res = Maybe<uint64_t>::FromNoError(node->Hash());
+    node->Release();
+    return res;
+}
+
+sol::Maybe<bool> sol::Value::StringEquals(Value other) {
+    if (!IsString() || !other.IsString()) return Maybe<bool>::FromError(ErrorWrongType);
+    StringNode* a = ((StringObject*)ToBase(*this))->Load();
+    StringNode* b = ((StringObject*)ToBase(other))->Load();
+    bool res = a == b;
+    if (!res && a->length == b->length) {
+        a->Release();
+        b->Release();
+        a = ((StringObject*)ToBase(*this))->LoadFlat();
+        b = ((StringObject*)ToBase(other))->LoadFlat();
+        res = a->UnitsEqual(b);
+    }
+    a->Release();
+    b->Release();
+    return Maybe<bool>::FromNoError(res);
+}
+
+sol::Maybe<sol::NullType> sol::Value::StringIntern() {
+    if (!IsString()) return Maybe<NullType>::FromError(ErrorWrongType);
+    StringObject* obj = (StringObject*)ToBase(*this);
+    StringNode* node = obj->LoadFlat();
+    StringNode* res = InternNode(node);
+    if (res == node) {
+        res->Release();
+        return Maybe<NullType>::FromNoError(NullType());
+    }
+    obj->Store(res);
+    return Maybe<NullType>::FromNoError(NullType());
+}
+
+void sol::EvictInternedStrings() {
+    for (auto& shard : internShards) {
+        shard.m.lock();
+        for (auto it = shard.nodes.begin(); it != shard.nodes.end();) {
+            StringNode* node = *it;
+            // Nothing can take a new reference to a node only the table holds without this lock
+            if (node->rc.load(std::memory_order_acquire) != 1) {
+                it++;
+                continue;
+            }
+            it = shard.nodes.erase(it);
+            node->Release();
+        }
+        shard.m.unlock();
+    }
+}
+
+sol::Maybe<sol::Value> sol::Value::StringSlice(std::size_t start, std::size_t end) {
+    if (!IsString()) return Maybe<Value>::FromError(ErrorWrongType);
+    StringNode* node = ((StringObject*)ToBase(*this))->LoadFlat();
+    end = std::min(end, node->length);
+    start = std::min(start, end);
+    StringNode* res = StringNode::Slice(node, start, end);
+    node->Release();
+    return Maybe<Value>::FromNoError(mknew(Make<StringObject>(res)));
+}
+
+sol::Maybe<sol::Value> sol::Value::StringConcat(Value other) {
+    if (!IsString() || !other.IsString()) return Maybe<Value>::FromError(ErrorWrongType);
+    StringNode* left = ((StringObject*)ToBase(*this))->Load();
+    StringNode* right = ((StringObject*)ToBase(other))->Load();
+    return Maybe<Value>::FromNoError(mknew(Make<StringObject>(StringNode::Concat(left, right))));
 }
 
 sol::Maybe<sol::NullType> sol::Value::StringSetValue(BaseString val) {
     if (!IsString()) return Maybe<NullType>::FromError(ErrorWrongType);
-    *((BaseString*)(CoreGet(cstringToVec8("str")))) = val;
+    StringObject* obj = (StringObject*)ToBase(*this);
+    bool locked = obj->shared.load(std::memory_order_acquire);
+    if (locked) obj->m.lock();
+    // A node nothing else uses is reused, one shared with copies is left to them
+    if (obj->node->type == StringNode::TypeFlat && obj->node->rc.load(std::memory_order_acquire) == 1) {
+        obj->node->SetFlat(std::move(val));
+        if (locked) obj->m.unlock();
+    } else {
+        if (locked) obj->m.unlock();
+        obj->Store(StringNode::NewFlat(std::move(val)));
+    }
     NullType res;
     return Maybe<NullType>::FromNoError(res);
 }
 
-template<typename T>
-sol::Error sol::Maybe<T>::GetError() {
-    return err;
+sol::Maybe<sol::NullType> sol::Value::StringSetCharAt(std::size_t i, uint16_t unit) {
+    if (!IsString()) return Maybe<NullType>::FromError(ErrorWrongType);
+    StringObject* obj = (StringObject*)ToBase(*this);
+    bool locked = obj->shared.load(std::memory_order_acquire);
+    if (locked) obj->m.lock();
+    if (i >= obj->node->length) {
+        if (locked) obj->m.unlock();
+        return Maybe<NullType>::FromError(ErrorNotFound);
+    }
+    StringNode* node = obj->Unique();
+    if (node->oneByte && unit > 0xFF) {
+        node->flat.Widen();
+        node->oneByte = false;
+        node->bytes = NULL;
+        node->chars = node->flat.chars.data();
+    }
+    if (node->oneByte) node->flat.bytes[i] = unit;
+    else node->flat.chars[i] = unit;
+    if (i < node->flat.litchars.size()) node->flat.litchars[i] = false;
+    node->hash.store(0, std::memory_order_relaxed);
+    if (locked) obj->m.unlock();
+    return Maybe<NullType>::FromNoError(NullType());
 }
 
 sol::Maybe<sol::vec8> sol::Value::StringGetUtf8Value() {
+    if (IsString()) {
+        // Valid UTF-8 buffers are already what we would encode
+        StringNode* node = ((StringObject*)ToBase(*this))->Load();
+        if (node->type == StringNode::TypeExternal && node->encoding == EncodingUtf8 && node->validUtf8) {
+            const uint8_t* in = (const uint8_t*)node->external;
+            Maybe<vec8> res = Maybe<vec8>::FromNoError(vec8(in, in + node->externalSize));
+            node->Release();
+            return res;
+        }
+        node->Release();
+    }
     Maybe<BaseString> r = StringGetValue();
     if (r.IsError()) return Maybe<vec8>::FromError(r.GetError());
     return Maybe<vec8>::FromNoError(stringToUtf8(r.ToNoError()));
@@ -630,49 +3274,26 @@ sol::Maybe<sol::NullType> sol::Value::StringSetUtf8Value(vec8 val) {
 
 sol::Maybe<bool> sol::Value::SymbolHasDescription() {
     if (!IsSymbol()) return Maybe<bool>::FromError(ErrorWrongType);
-    sym_m.lock();
-    mpf_ptr sym = (mpf_ptr)CoreGet(cstringToVec8("sym"));
-    for (auto i : symdescs) {
-        if (mpf_cmp(i.first, sym) == 0) {
-            Maybe<bool> res = Maybe<bool>::FromNoError(true);
-            SOL_MUNLOCKRET(sym_m, res)
-        }
-    }
-    Maybe<bool> res = Maybe<bool>::FromNoError(false);
-    SOL_MUNLOCKRET(sym_m, res)
+    SymbolData* data = ((SymbolObject*)ToBase(*this))->data;
+    return Maybe<bool>::FromNoError(data->description.load(std::memory_order_acquire) != NULL);
 }
 
 sol::Maybe<sol::BaseString> sol::Value::SymbolGetDescription() {
     if (!IsSymbol()) return Maybe<BaseString>::FromError(ErrorWrongType);
-    sym_m.lock();
-    mpf_ptr sym = (mpf_ptr)CoreGet(cstringToVec8("sym"));
-    for (auto i : symdescs) {
-        if (mpf_cmp(i.first, sym) == 0) {
-            Maybe<BaseString> res = Maybe<BaseString>::FromNoError(i.second);
-            SOL_MUNLOCKRET(sym_m, res)
-        }
-    }
-    Maybe<BaseString> res = Maybe<BaseString>::FromError(ErrorNotFound);
-    SOL_MUNLOCKRET(sym_m, res)
+    BaseString desc;
+    if (!((SymbolObject*)ToBase(*this))->data->GetDescription(desc)) return Maybe<BaseString>::FromError(ErrorNotFound);
+    return Maybe<BaseString>::FromNoError(desc);
+}
+
+sol::Maybe<sol::BaseString> sol::Value::SymbolKeyFor() {
+    if (!IsSymbol()) return Maybe<BaseString>::FromError(ErrorWrongType);
+    StringNode* key = ((SymbolObject*)ToBase(*this))->data->registryKey;
+    if (key == NULL) return Maybe<BaseString>::FromError(ErrorNotFound);
+    return Maybe<BaseString>::FromNoError(key->Flatten());
 }
 
 sol::Maybe<sol::NullType> sol::Value::SymbolSetDescription(BaseString desc) {
     if (!IsSymbol()) return Maybe<NullType>::FromError(ErrorWrongType);
-    sym_m.lock();
-    mpf_ptr sym = (mpf_ptr)CoreGet(cstringToVec8("sym"));
-    for (std::size_t i = 0; i < symdescs.size(); i++) {
-        auto val = symdescs[i];
-        if (mpf_cmp(val.first, sym) == 0) {
-            val.second = desc;
-            symdescs[i] = val;
-            NullType n;
-            Maybe<NullType> res = Maybe<NullType>::FromNoError(n);
-            SOL_MUNLOCKRET(sym_m, res)
-        }
-    }
-    mpf_ptr s = new mpf_t;
-    mpf_init_set(s, sym);
-    symdescs.emplace_back(s, desc);
-    Maybe<NullType> res = Maybe<NullType>::FromNoError(NullType());
-    SOL_MUNLOCKRET(sym_m, res)
+    ((SymbolObject*)ToBase(*this))->data->SetDescription(std::move(desc));
+    return Maybe<NullType>::FromNoError(NullType());
 }
\ No newline at end of file
@@ -2,22 +2,37 @@
 #define SOL_ENGINE_BASE
 
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <thread>
 #include <vector>
+#include <deque>
 #include <cinttypes>
 #include <functional>
 #include <string>
+#include <chrono>
 
 namespace sol {
     // Aliases for commonly used types
     using voidfn = std::function<void()>;
     using vec8 = std::vector<uint8_t>;
     using vec16 = std::vector<uint16_t>;
+    // An interned key. Equal keys always give the same `Atom`, so they can be compared by pointer
+    using Atom = const vec8*;
     struct Value;
     struct Thread;
     struct InitsManager;
     struct BaseString;
     struct NullType;
+    struct Persistent;
+    struct HandleScope;
+    struct EventLoop;
+    // The encodings a string's buffer can be in
+    enum Encoding {
+        EncodingUtf8,
+        EncodingLatin1,
+        EncodingUtf16
+    };
     // An error for when a `Maybe` represents an error
     enum Error {
         ErrorNoError,
@@ -29,41 +44,79 @@ namespace sol {
     struct Maybe {
         Error err;
         T val;
-        static Maybe<T> FromNoError(T v);
-        static Maybe<T> FromError(Error e);
-        bool IsError();
-        T ToNoError();
-        Error GetError();
+        // Defined here so every `Maybe` the API returns can be used from outside Sol
+        static Maybe<T> FromNoError(T v) {
+            Maybe<T> res;
+            res.err = ErrorNoError;
+            res.val = v;
+            return res;
+        }
+        static Maybe<T> FromError(Error e) {
+            Maybe<T> res;
+            res.err = e;
+            return res;
+        }
+        bool IsError() {
+            return err != ErrorNoError;
+        }
+        T ToNoError() {
+            return val;
+        }
+        Error GetError() {
+            return err;
+        }
     };
-    // The type of all JS Values
+    // The type of all JS Values. `undefined`, `null`, booleans and numbers are stored inline in `_`, everything else is a pointer to the heap
     struct Value {
-        void* _;
+        uint64_t _;
         // Should not be used outside Sol's internals
         void CoreSet(vec8 key, void* val);
         // Should not be used outside Sol's internals
         void* CoreGet(vec8 key);
         // Should not be used outside Sol's internals
         bool CoreHas(vec8 key);
+        // Should not be used outside Sol's internals
+        void CoreSet(Atom key, void* val);
+        // Should not be used outside Sol's internals
+        void* CoreGet(Atom key);
+        // Should not be used outside Sol's internals
+        bool CoreHas(Atom key);
         // Creates a new `Value` with the value of JS's `undefined`
         static Value NewUndefined();
-        // Creates a copy of this `Value`
+        // Creates a copy of this `Value`. Copies of strings share their contents until one of them is changed
         Value Copy();
-        // Garbage collects this `Value`
+        // Garbage collects this `Value`. If other values still reference it or a `Persistent` handle holds it, it is only made not persistent and freed once nothing reaches it
         void Collect();
         // Creates a new `Value` with the value of JS's `null`
         static Value NewNull();
         // Makes this `Value` not persistent, meaning it will be garbage collected when other values need it
         void MakeNotPersistent();
-        // Makes this `Value` persistent, meaning it won't be garbage collected automatically, which is the default when you create new `Values`
+        // Makes this `Value` persistent, meaning it won't be garbage collected automatically, which is the default when you create new `Values` outside a `HandleScope`
         void MakePersistent();
+        // Makes this `Value` keep `val` alive for as long as this `Value` is reachable
+        void AddReference(Value val);
+        // Undoes one `AddReference(val)`
+        void RemoveReference(Value val);
         // Creates a new `Value` with its value being a JS string having the value `val`
         static Value NewString(BaseString val);
+        // Creates a new `Value` with its value being a JS string read straight from `data`, which holds `size` code units in `encoding`, without copying it. `data` must stay valid until `release` is called, which can happen on any thread
+        static Value NewExternalString(const void* data, std::size_t size, Encoding encoding, voidfn release);
         // Creates a new `Value` with its value being a JS symbol with no description
         static Value NewSymbol();
         // Creates a new `Value` with its value being a JS symbol with the description `desc`
         static Value NewSymbolWithDescription(BaseString desc);
-        // Returns whether this `Value` is persistent
+        // Returns a new `Value` for the symbol registered globally under `key`, registering a new one described by `key` the first time. Every thread gets the same symbol for the same key, like JS's `Symbol.for`, and looking one up that's already registered doesn't lock anything
+        static Value SymbolFor(BaseString key);
+        // Creates a new `Value` with its value being the JS boolean `val`
+        static Value NewBoolean(bool val);
+        // Creates a new `Value` with its value being the JS number `val`
+        static Value NewNumber(double val);
+        // Returns whether this `Value` is persistent or has a `Persistent` handle. Values stored inline are never collected, so they are always persistent
         bool IsPersistent();
+        // Makes this `Value` safe to use from other `Thread`s. Until then it is only used by the thread that created it, so call this before handing it to another thread
+        void MakeShared();
+        // Returns whether this `Value` can be used from other `Thread`s. Values stored inline always can
+        bool IsShared();
         // Returns whether this `Value` has the value of `undefined`
         bool IsUndefined();
         // Returns whether this `Value` has the value of `null`
@@ -72,10 +125,34 @@ namespace sol {
         bool IsString();
         // Returns whether this `Value` is a JS symbol
         bool IsSymbol();
-        // Returns the string's contents if this `Value` is a string, otherwise returns `ErrorWrongType`
+        // Returns whether this `Value` is a JS boolean
+        bool IsBoolean();
+        // Returns whether this `Value` is a JS number
+        bool IsNumber();
+        // Returns the boolean's value if this `Value` is a boolean, otherwise returns `ErrorWrongType`
+        Maybe<bool> BooleanGetValue();
+        // Returns the number's value if this `Value` is a number, otherwise returns `ErrorWrongType`
+        Maybe<double> NumberGetValue();
+        // Returns the string's contents if this `Value` is a string, otherwise returns `ErrorWrongType`. Strings whose code units all fit in a byte come back as Latin-1 in `bytes` with `chars` empty, so read them with `Size` and `At` or `Widen` them first
         Maybe<BaseString> StringGetValue();
+        // Returns how many UTF-16 code units the string has if this `Value` is a string, otherwise returns `ErrorWrongType`
+        Maybe<std::size_t> StringGetLength();
+        // Returns the code unit at `i` if this `Value` is a string, otherwise returns `ErrorWrongType`. If `i` is past the end it returns `ErrorNotFound`
+        Maybe<uint16_t> StringGetCharAt(std::size_t i);
+        // Returns a new string `Value` with the code units from `start` up to `end` if this `Value` is a string, otherwise returns `ErrorWrongType`. Both are clamped to the length. Big enough slices share the string's storage instead of copying it
+        Maybe<Value> StringSlice(std::size_t start, std::size_t end);
+        // Returns a new string `Value` with this string followed by `other` if both are strings, otherwise returns `ErrorWrongType`. Only short pieces are copied right away, the rest isn't copied until it's read, so building a string by appending takes time linear in its length
+        Maybe<Value> StringConcat(Value other);
+        // Returns the hash of the string's contents if this `Value` is a string, otherwise returns `ErrorWrongType`. It's only computed once per string
+        Maybe<uint64_t> StringGetHash();
+        // Returns whether both strings have the same contents if this `Value` and `other` are strings, otherwise returns `ErrorWrongType`
+        Maybe<bool> StringEquals(Value other);
+        // Makes the string share its contents with every other interned string equal to it if this `Value` is a string, otherwise returns `ErrorWrongType`. Equal interned strings compare in O(1)
+        Maybe<NullType> StringIntern();
         // Sets the string's contents to `val` if this `Value` is a string, otherwise returns `ErrorWrongType`
         Maybe<NullType> StringSetValue(BaseString val);
+        // Sets the code unit at `i` to `unit` if this `Value` is a string, otherwise returns `ErrorWrongType`. If `i` is past the end it returns `ErrorNotFound`. Copies of the string don't see the change
+        Maybe<NullType> StringSetCharAt(std::size_t i, uint16_t unit);
         // Equivalent to `StringGetValue`ing, asserting that no `Error` occured, and `stringToUtf8`ing the result
         Maybe<vec8> StringGetUtf8Value();
         // Equivalent to `utf8ToString`ing `val`, and `StringSetValue`ing the result
@@ -84,25 +161,107 @@ namespace sol {
         Maybe<bool> SymbolHasDescription();
         // Returns the symbol's description if there is any, otherwise returning `ErrorNotFound`. If this `Value` isn't a symbol, it retuns `ErrorWrongType`
         Maybe<BaseString> SymbolGetDescription();
-        // Sets the symbol's description to `desc` if this `Value` is a symbol, otherwise returns `ErrorWrongType`
+        // Returns the key the symbol was registered under by `SymbolFor`, or `ErrorNotFound` if it wasn't, like JS's `Symbol.keyFor`. If this `Value` isn't a symbol, it returns `ErrorWrongType`
+        Maybe<BaseString> SymbolKeyFor();
+        // Sets the symbol's description to `desc` if this `Value` is a symbol, otherwise returns `ErrorWrongType`. The old description is freed right away unless another thread is reading it, in which case it waits for a later change or for the symbol to be freed
         Maybe<NullType> SymbolSetDescription(BaseString desc);
     };
     // A void type that works for `Maybe`s
     struct NullType {};
+    // A handle that keeps a `Value` alive until it's disposed, no matter whether the `Value` is persistent. Making and disposing one doesn't lock anything
+    struct Persistent {
+        Value val;
+        static Persistent New(Value val);
+        Value Get();
+        void Dispose();
+    };
+    // While one is open, the `Value`s made on its thread aren't persistent. Instead they are kept alive until the scope closes and released all at once. Keep them on the stack so they close in reverse order
+    struct HandleScope {
+        void* handles;
+        std::size_t start;
+        HandleScope();
+        ~HandleScope();
+    };
     // Inits Sol. You should do this before starting to use Sol
     void Init();
     // Deinits Sol. Do this when you finished doing what you wanted to do with Sol, generally before the program exits
     void Teardown();
-    // A thread in a way you can manage it
+    // Frees every `Value` that isn't persistent and can't be reached from a persistent `Value` through references. This also happens on its own as the heap grows
+    void CollectGarbage();
+    // Drops the interned strings no string `Value` uses anymore. `CollectGarbage` does this too
+    void EvictInternedStrings();
+    // Sets how many threads mark the heap during a full collection, counting the collecting thread. Defaults to the number of hardware threads
+    void SetGCMarkerThreads(std::size_t count);
+    // Sets whether the heap growing starts an incremental collection, which is done a little at a time on allocation and in `GCIdleStep`, instead of a full one
+    void SetGCIncremental(bool incremental);
+    // Lets the garbage collector work for up to `budget`, starting a collection early if it's worth it. Returns whether a collection is still in progress
+    bool GCIdleStep(std::chrono::microseconds budget);
+    // A task that runs on Sol's work-stealing scheduler. Thread pool workers run them, so spawning one doesn't start an OS thread
     struct Thread {
-        std::thread t;
-        std::thread w;
+        voidfn code;
+        // The `Thread` this one was spawned from, `NULL` for ones made with `New`
+        Thread* parent = NULL;
+        // 1 until the code is done, plus how many children aren't done yet with all of theirs
+        std::atomic<std::size_t> pending = 1;
         std::mutex tm;
-        std::mutex wm;
+        std::condition_variable done;
+        // The children spawned from this one, freed along with it
         std::vector<Thread*> st;
+        // How many of `st` `Wait` has already run or seen started
+        std::size_t claimed = 0;
+        // Set by whichever of the scheduler or a waiting parent gets to run the code first
+        std::atomic<bool> started = false;
+        // Made the first time `Loop` is called
+        std::atomic<EventLoop*> loop = NULL;
         static Thread* New(voidfn code);
+        // Spawns a child `Thread`, which `Wait` waits for too
         Thread* Spawn(voidfn code);
+        // Waits until the code and every child spawned from this `Thread`, and theirs, are done. A worker runs the children that haven't started itself, then hands its other tasks to a spare thread while it blocks
         void Wait();
+        // Returns this `Thread`'s event loop, making it if it doesn't have one yet. Any thread may call this to `Post` to it
+        EventLoop* Loop();
+        ~Thread();
+    };
+    // A JS event loop. Only the `Thread` it belongs to runs it and queues tasks on it directly, other threads `Post` theirs
+    struct EventLoop {
+        // A task posted from another thread
+        struct Posted {
+            voidfn code;
+            std::atomic<Posted*> next = NULL;
+        };
+        // Posted tasks, a lock-free queue many threads push to and only the loop takes from. `postedHead` is the newest one, `stub` is a placeholder that keeps it from ever being empty
+        std::atomic<Posted*> postedHead;
+        Posted* postedTail;
+        Posted stub;
+        std::deque<voidfn> macrotasks;
+        std::deque<voidfn> microtasks;
+        // How many things that will post tasks later are pending, `Run` doesn't return while there are any
+        std::atomic<std::size_t> refs = 0;
+        // Set while `Run` waits for posted tasks, so posting only wakes it when it needs to
+        std::atomic<bool> sleeping = false;
+        std::mutex m;
+        std::condition_variable wake;
+        EventLoop();
+        ~EventLoop();
+        // Queues `code` to run right after the current task, before any other macrotask. Only from the loop's `Thread`
+        void QueueMicrotask(voidfn code);
+        // Queues `code` to run after the tasks already queued. Only from the loop's `Thread`
+        void QueueMacrotask(voidfn code);
+        // Queues `code` as a macrotask from any thread, without locking anything
+        void Post(voidfn code);
+        // Keeps `Run` from returning until a matching `Unref`, for as long as something may still `Post` to the loop. Both work from any thread
+        void Ref();
+        void Unref();
+        // Runs macrotasks and the microtasks each one queues until there are none left and nothing holds a ref. Before it sleeps waiting for posted ones, it hands its scheduler worker to a spare thread, so other `Thread`s never run underneath it
+        void Run();
+        // Runs the next macrotask and the microtasks after it, or the microtasks already queued if there are any, without waiting. Returns whether it ran anything
+        bool RunOnce();
+        // Wakes `Run` while it sleeps
+        void Wake();
+        // Moves the posted tasks to `macrotasks`
+        void TakePosted();
+        // Returns whether a task was posted and not taken yet
+        bool HasPosted();
     };
     // A class to manage your inits and deinits
     struct InitsManager {
@@ -115,22 +274,72 @@ namespace sol {
         void Deinit();
     };
     // An inits manager for initializing and deinitializing Sol	
-    InitsManager GlobalIM;
-    // Spawns a thread using the `Thread` for the current thread, won't work if this thread doesn't have a `Thread`
+    inline InitsManager GlobalIM;
+    // Spawns a thread using the `Thread` the current thread is running, which is a single thread-local load. Only works from inside a `Thread`
     Thread* SpawnThread(voidfn code);
+    // Returns the event loop of the `Thread` the current thread is running. Only works from inside a `Thread`
+    EventLoop* CurrentEventLoop();
+#if defined(__linux__)
+    // Asynchronous reads and writes of files, pipes and sockets, through io_uring where the kernel has it and epoll otherwise. A poller thread submits everything queued since it last woke up at once and reaps every completion it finds, and each callback runs as a macrotask on the event loop of the `Thread` that started the operation, which keeps running until then
+    namespace io {
+        // Called with how many bytes were read or written, or `-errno` if the operation failed
+        using Callback = std::function<void(int64_t)>;
+        struct Buffer {
+            uint8_t* data;
+            std::size_t size;
+        };
+        // Reads up to `size` bytes of `fd` into `buf` at `offset`, or at the current position if it's -1. Pipes and sockets ignore `offset`. Only from inside a `Thread`, and `buf` must stay valid until `done` runs. With epoll, pipes and sockets are made non-blocking
+        void Read(int fd, void* buf, std::size_t size, int64_t offset, Callback done);
+        // Writes up to `size` bytes of `buf` to `fd` at `offset`, or at the current position if it's -1. Same rules as `Read`
+        void Write(int fd, const void* buf, std::size_t size, int64_t offset, Callback done);
+        // Registers `bufs` with the kernel in place of the ones registered before, so `ReadFixed` reads into them without mapping them every time. Returns whether the kernel took them, reading into them works either way. Don't replace buffers reads are still using
+        bool RegisterBuffers(std::vector<Buffer> bufs);
+        // Like `Read`, into the start of the registered buffer at `index` and up to its size
+        void ReadFixed(int fd, std::size_t index, int64_t offset, Callback done);
+        // Returns whether operations go through io_uring
+        bool UsingIoUring();
+    }
+#endif
     // Convert a `char*` to an array of bytes
     vec8 cstringToVec8(char* cstr);
     // Compare two arrays of bytes for equality
     bool vec8Compare(vec8 v1, vec8 v2);
     // Converts an array of bytes into an `std::string`
     std::string vec8ToStdString(vec8 v);
-    // A UTF-16 string
+    // Returns the `Atom` for `key`, interning it if it wasn't interned yet
+    Atom Intern(vec8 key);
+    // Returns the `Atom` for `key` if it was interned, otherwise returns `NULL`
+    Atom FindAtom(vec8 key);
+    // A UTF-16 string. When every code unit fits in a byte it can be kept as Latin-1 in `bytes` instead, see `oneByte`
     struct BaseString {
         vec16 chars;
-        std::vector<std::size_t> litchars;
+        // Which code units are surrogates that stay on their own even next to one they could pair with, indexed like `chars`. Empty if there are none
+        std::vector<bool> litchars;
+        // The code units when `oneByte` is set, in which case `chars` and `litchars` are empty
+        vec8 bytes;
+        bool oneByte = false;
+        // Returns how many code units there are
+        std::size_t Size() const;
+        // Returns the code unit at `i`
+        uint16_t At(std::size_t i) const;
+        // Moves the code units to `chars` if they are in `bytes`
+        void Widen();
+        // Moves the code units to `bytes` if they all fit in a byte
+        void Compact();
     };
-    // Convert an array of UTF-8 bytes to a UTF-16 `BaseString`
+    // Convert an array of UTF-8 bytes to a `BaseString`. When every code unit fits in a byte the result is Latin-1 in `bytes` with `oneByte` set and `chars` left empty, so read it with `Size` and `At` or `Widen` it first
     BaseString utf8ToString(vec8 val);
+    // Decodes UTF-8 that arrives in chunks. A sequence split between two chunks is kept until the chunk that finishes it
+    struct Utf8Decoder {
+        uint8_t pending[4];
+        std::size_t pendingSize = 0;
+        // Decodes the `size` bytes at `data` onto the end of `out`. An empty `out` starts out one byte per code unit and only widens once a code unit doesn't fit, like `utf8ToString`
+        void Decode(const uint8_t* data, std::size_t size, BaseString& out);
+        // Returns a new string `Value` with the string `str` followed by the decoded bytes if `str` is a string, otherwise returns `ErrorWrongType`. The chunks aren't copied together until the result is read
+        Maybe<Value> DecodeAppend(Value str, const uint8_t* data, std::size_t size);
+        // Ends the input, dropping a sequence that was never finished like `utf8ToString` does. Returns whether there was one
+        bool Finish();
+    };
     // Converts an UTF-16 `BaseString` to an array of UTF-8 bytes
     vec8 stringToUtf8(BaseString val);
 }
@@ -0,0 +1,284 @@
+#include <sol-base.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <thread>
+
+// Exits with a message if `cond` doesn't hold, even in builds without asserts
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); exit(1); }
+
+sol::vec8 Bytes(const char* s) {
+    return sol::vec8(s, s + strlen(s));
+}
+
+sol::Value Str(const char* s) {
+    return sol::Value::NewString(sol::utf8ToString(Bytes(s)));
+}
+
+std::string Utf8(sol::Value v) {
+    return sol::vec8ToStdString(v.StringGetUtf8Value().ToNoError());
+}
+
+// Values stored inline, and the errors `Maybe` carries back
+void TestInline() {
+    CHECK(sol::Value::NewUndefined().IsUndefined())
+    CHECK(sol::Value::NewNull().IsNull())
+    CHECK(sol::Value::NewBoolean(true).BooleanGetValue().ToNoError())
+    sol::Maybe<double> n = sol::Value::NewNumber(1.5).NumberGetValue();
+    CHECK(!n.IsError() && n.ToNoError() == 1.5)
+    sol::Maybe<double> wrong = sol::Value::NewNull().NumberGetValue();
+    CHECK(wrong.IsError() && wrong.GetError() == sol::ErrorWrongType)
+    CHECK(sol::Value::NewNumber(2).IsPersistent() && sol::Value::NewNumber(2).IsShared())
+}
+
+// Keys interned once and looked up by `Atom` or by bytes
+void TestProperties() {
+    sol::Atom a = sol::Intern(Bytes("length"));
+    CHECK(a == sol::Intern(Bytes("length")))
+    CHECK(sol::FindAtom(Bytes("length")) == a)
+    CHECK(sol::FindAtom(Bytes("never interned")) == NULL)
+    sol::Value obj = sol::Value::NewSymbol();
+    int x = 1, y = 2;
+    obj.CoreSet(a, &x);
+    obj.CoreSet(Bytes("other"), &y);
+    CHECK(obj.CoreGet(a) == &x && obj.CoreGet(Bytes("length")) == &x)
+    CHECK(obj.CoreHas(Bytes("other")) && obj.CoreGet(sol::Intern(Bytes("other"))) == &y)
+    CHECK(!obj.CoreHas(Bytes("missing")))
+    obj.CoreSet(a, &y);
+    CHECK(obj.CoreGet(a) == &y)
+    obj.Collect();
+}
+
+// Decoding UTF-8 whole and in chunks, and encoding it back
+void TestUtf8() {
+    sol::BaseString s = sol::utf8ToString(Bytes("h\xC3\xA9llo"));
+    CHECK(s.Size() == 5 && s.At(1) == 0xE9)
+    s.Widen();
+    CHECK(!s.oneByte && s.chars.size() == 5 && s.chars[1] == 0xE9)
+    sol::BaseString wide = sol::utf8ToString(Bytes("\xF0\x9F\x98\x80"));
+    CHECK(wide.Size() == 2 && wide.At(0) == 0xD83D && wide.At(1) == 0xDE00)
+    CHECK(sol::stringToUtf8(wide) == Bytes("\xF0\x9F\x98\x80"))
+    sol::Utf8Decoder d;
+    sol::BaseString out;
+    d.Decode((const uint8_t*)"a\xF0\x9F", 3, out);
+    d.Decode((const uint8_t*)"\x98\x80" "b", 3, out);
+    CHECK(!d.Finish())
+    CHECK(out.Size() == 4 && out.At(1) == 0xD83D && out.At(3) == 'b')
+    sol::Utf8Decoder cut;
+    sol::BaseString rest;
+    cut.Decode((const uint8_t*)"x\xE2\x82", 3, rest);
+    CHECK(cut.Finish() && rest.Size() == 1)
+    // Appending to a string `Value` decodes onto its contents
+    sol::Value str = Str("ab");
+    sol::Utf8Decoder app;
+    str = app.DecodeAppend(str, (const uint8_t*)"c\xC3", 2).ToNoError();
+    str = app.DecodeAppend(str, (const uint8_t*)"\xA9", 1).ToNoError();
+    CHECK(!app.Finish() && Utf8(str) == "abc\xC3\xA9")
+    str.Collect();
+}
+
+// Strings made, read, sliced, joined, interned and changed through `Value`
+void TestStrings() {
+    sol::Value s = Str("hello world");
+    CHECK(s.IsString() && s.StringGetLength().ToNoError() == 11)
+    CHECK(s.StringGetCharAt(4).ToNoError() == 'o')
+    CHECK(s.StringGetCharAt(11).GetError() == sol::ErrorNotFound)
+    CHECK(sol::Value::NewNull().StringGetLength().GetError() == sol::ErrorWrongType)
+    sol::Value world = s.StringSlice(6, 100).ToNoError();
+    CHECK(Utf8(world) == "world")
+    sol::Value joined = world.StringConcat(Str("!")).ToNoError();
+    CHECK(Utf8(joined) == "world!" && joined.StringGetLength().ToNoError() == 6)
+    sol::Value again = Str("world!");
+    CHECK(joined.StringEquals(again).ToNoError())
+    CHECK(joined.StringGetHash().ToNoError() == again.StringGetHash().ToNoError())
+    CHECK(!joined.StringIntern().IsError() && !again.StringIntern().IsError())
+    CHECK(joined.StringEquals(again).ToNoError())
+    sol::Value copy = s.Copy();
+    CHECK(!s.StringSetCharAt(0, 'j').IsError())
+    CHECK(Utf8(s) == "jello world" && Utf8(copy) == "hello world")
+    CHECK(!s.StringSetUtf8Value(Bytes("caf\xC3\xA9")).IsError())
+    CHECK(s.StringGetValue().ToNoError().Size() == 4 && Utf8(s) == "caf\xC3\xA9")
+    // Many appends stay cheap and read back in order
+    sol::Value built = Str("");
+    for (int i = 0; i < 1000; i++) built = built.StringConcat(Str("ab")).ToNoError();
+    CHECK(built.StringGetLength().ToNoError() == 2000 && built.StringGetCharAt(1999).ToNoError() == 'b')
+    sol::Value front = Str("z");
+    for (int i = 0; i < 1000; i++) front = Str("xy").StringConcat(front).ToNoError();
+    CHECK(front.StringGetLength().ToNoError() == 2001 && front.StringGetCharAt(1).ToNoError() == 'y')
+    sol::Value both = built.StringConcat(front).ToNoError();
+    CHECK(both.StringGetCharAt(1999).ToNoError() == 'b' && both.StringGetCharAt(2000).ToNoError() == 'x')
+    CHECK(Utf8(both).size() == 4001 && Utf8(both).back() == 'z')
+    for (sol::Value v : {s, copy, world, joined, again, built, front, both}) v.Collect();
+}
+
+// External strings are read in place and released once they're freed
+void TestExternal() {
+    static const char latin1[] = "external";
+    static const uint16_t utf16[] = {'h', 0xE9};
+    std::atomic<int> released = 0;
+    sol::Value a = sol::Value::NewExternalString(latin1, 8, sol::EncodingLatin1, [&](){ released++; });
+    sol::Value b = sol::Value::NewExternalString(utf16, 2, sol::EncodingUtf16, [&](){ released++; });
+    CHECK(Utf8(a) == "external" && Utf8(b) == "h\xC3\xA9")
+    CHECK(a.StringSlice(0, 3).ToNoError().StringEquals(Str("ext")).ToNoError())
+    a.Collect();
+    b.Collect();
+    sol::CollectGarbage();
+    CHECK(released == 2)
+}
+
+// Symbols, their descriptions and the global registry
+void TestSymbols() {
+    sol::Value plain = sol::Value::NewSymbol();
+    CHECK(plain.IsSymbol() && !plain.SymbolHasDescription().ToNoError())
+    CHECK(plain.SymbolGetDescription().GetError() == sol::ErrorNotFound)
+    sol::Value described = sol::Value::NewSymbolWithDescription(sol::utf8ToString(Bytes("desc")));
+    CHECK(sol::stringToUtf8(described.SymbolGetDescription().ToNoError()) == Bytes("desc"))
+    sol::Value shared = described.Copy();
+    CHECK(!shared.SymbolSetDescription(sol::utf8ToString(Bytes("changed"))).IsError())
+    CHECK(sol::stringToUtf8(described.SymbolGetDescription().ToNoError()) == Bytes("changed"))
+    for (int i = 0; i < 1000; i++) described.SymbolSetDescription(sol::utf8ToString(Bytes(i % 2 ? "odd" : "even")));
+    CHECK(sol::stringToUtf8(shared.SymbolGetDescription().ToNoError()) == Bytes("odd"))
+    sol::Value reg = sol::Value::SymbolFor(sol::utf8ToString(Bytes("app.key")));
+    sol::Value same = sol::Value::SymbolFor(sol::utf8ToString(Bytes("app.key")));
+    CHECK(sol::stringToUtf8(same.SymbolKeyFor().ToNoError()) == Bytes("app.key"))
+    CHECK(plain.SymbolKeyFor().GetError() == sol::ErrorNotFound)
+    CHECK(sol::Value::NewNull().SymbolKeyFor().GetError() == sol::ErrorWrongType)
+    for (sol::Value v : {plain, described, shared, reg, same}) v.Collect();
+}
+
+// What keeps values alive across collections
+void TestGC() {
+    sol::Value kept = Str("kept");
+    sol::Value held = Str("held");
+    kept.AddReference(held);
+    held.MakeNotPersistent();
+    CHECK(!held.IsPersistent())
+    sol::CollectGarbage();
+    CHECK(Utf8(held) == "held")
+    {
+        sol::HandleScope scope;
+        sol::Value temp = Str("temp");
+        CHECK(!temp.IsPersistent())
+        sol::CollectGarbage();
+        CHECK(Utf8(temp) == "temp")
+    }
+    sol::Value handled = Str("handled");
+    sol::Persistent p = sol::Persistent::New(handled);
+    handled.MakeNotPersistent();
+    CHECK(handled.IsPersistent())
+    sol::CollectGarbage();
+    CHECK(Utf8(p.Get()) == "handled")
+    // Collecting a value a handle still holds leaves it to the handle
+    sol::Value pinned = Str("pinned");
+    sol::Persistent q = sol::Persistent::New(pinned);
+    pinned.Collect();
+    sol::CollectGarbage();
+    CHECK(Utf8(q.Get()) == "pinned")
+    q.Dispose();
+    p.Dispose();
+    kept.RemoveReference(held);
+    kept.Collect();
+    sol::CollectGarbage();
+    sol::EvictInternedStrings();
+    // Several markers and incremental collections over a bigger heap
+    sol::SetGCMarkerThreads(4);
+    sol::Value root = sol::Value::NewSymbol();
+    for (int i = 0; i < 20000; i++) {
+        sol::Value v = sol::Value::NewSymbol();
+        root.AddReference(v);
+        v.MakeNotPersistent();
+    }
+    sol::CollectGarbage();
+    sol::SetGCIncremental(true);
+    for (int i = 0; i < 20000; i++) sol::Value::NewSymbol().MakeNotPersistent();
+    while (sol::GCIdleStep(std::chrono::microseconds(1000))) {}
+    sol::SetGCIncremental(false);
+    sol::SetGCMarkerThreads(1);
+    root.Collect();
+    sol::CollectGarbage();
+}
+
+// Threads spawned on the scheduler, and values shared between them
+void TestThreads() {
+    sol::Value shared = Str("shared");
+    shared.MakeShared();
+    CHECK(shared.IsShared())
+    std::atomic<int> ran = 0;
+    sol::Thread* t = sol::Thread::New([&](){
+        for (int i = 0; i < 8; i++) sol::SpawnThread([&](){
+            CHECK(Utf8(shared) == "shared")
+            ran++;
+        });
+        sol::EventLoop* loop = sol::CurrentEventLoop();
+        loop->QueueMacrotask([&](){
+            loop->QueueMicrotask([&](){ ran++; });
+        });
+        loop->Run();
+    });
+    t->Wait();
+    CHECK(ran == 9)
+    shared.Collect();
+}
+
+// More loops waiting at once than there are workers, each ended from outside in the order they were started
+void TestLoops() {
+    std::size_t n = std::thread::hardware_concurrency() + 2;
+    std::atomic<std::size_t> started = 0;
+    std::vector<sol::Thread*> ts;
+    for (std::size_t i = 0; i < n; i++) ts.push_back(sol::Thread::New([&](){
+        sol::EventLoop* loop = sol::CurrentEventLoop();
+        loop->Ref();
+        started++;
+        loop->Run();
+    }));
+    while (started != n) std::this_thread::yield();
+    for (auto t : ts) {
+        sol::EventLoop* loop = t->Loop();
+        loop->Post([loop](){
+            loop->Unref();
+        });
+        t->Wait();
+    }
+}
+
+// A `Thread` waiting on more loops than there are workers, which only finish once it's waiting
+void TestWaitOnLoops() {
+    std::size_t n = std::thread::hardware_concurrency() + 2;
+    std::atomic<std::size_t> started = 0;
+    std::vector<sol::EventLoop*> loops(n);
+    std::atomic<bool> waiting = false;
+    sol::Thread* parent = sol::Thread::New([&](){
+        sol::Thread* mid = sol::SpawnThread([&](){
+            for (std::size_t i = 0; i < n; i++) sol::SpawnThread([&, i](){
+                loops[i] = sol::CurrentEventLoop();
+                loops[i]->Ref();
+                started++;
+                loops[i]->Run();
+            });
+        });
+        waiting = true;
+        mid->Wait();
+    });
+    while (!waiting || started != n) std::this_thread::yield();
+    for (auto loop : loops) loop->Post([loop](){
+        loop->Unref();
+    });
+    parent->Wait();
+}
+
+int main() {
+    sol::Init();
+    TestInline();
+    TestProperties();
+    TestUtf8();
+    TestStrings();
+    TestExternal();
+    TestSymbols();
+    TestGC();
+    TestThreads();
+    TestLoops();
+    TestWaitOnLoops();
+    sol::Teardown();
+    puts("ok");
+}
@@ -0,0 +1,161 @@
+#include <sol-base.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Exits with a message if `cond` doesn't hold, even in builds without asserts
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); exit(1); }
+
+// Writes to a file, reads parts of it back, and reads it into a registered buffer
+void TestFile() {
+    char path[] = "/tmp/sol-io-XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0)
+    static char buf[16], fixed[5], many[1];
+    static int reads;
+    std::string log;
+    reads = 0;
+    sol::Thread* t = sol::Thread::New([&](){
+        sol::EventLoop* loop = sol::CurrentEventLoop();
+        sol::io::Write(fd, "hello world", 11, 0, [&](int64_t n){
+            CHECK(n == 11)
+            log += "w";
+            sol::io::Read(fd, buf, sizeof(buf), 6, [&](int64_t n){
+                CHECK(n == 5 && memcmp(buf, "world", 5) == 0)
+                log += "r";
+                // Microtasks run before the next completion is delivered
+                loop->QueueMicrotask([&](){
+                    log += "m";
+                });
+            });
+            sol::io::RegisterBuffers({{(uint8_t*)fixed, sizeof(fixed)}});
+            sol::io::ReadFixed(fd, 0, 0, [&](int64_t n){
+                CHECK(n == 5 && memcmp(fixed, "hello", 5) == 0)
+                log += "f";
+            });
+            sol::io::ReadFixed(fd, 1, 0, [&](int64_t n){
+                CHECK(n == -EINVAL)
+                log += "e";
+            });
+            // Enough at once that they're submitted and reaped in batches
+            for (int i = 0; i < 1000; i++) {
+                sol::io::Read(fd, many, 1, i % 11, [](int64_t n){
+                    CHECK(n == 1)
+                    reads++;
+                });
+            }
+        });
+        loop->Run();
+    });
+    t->Wait();
+    CHECK(log.find("rm") != std::string::npos)
+    std::sort(log.begin(), log.end());
+    CHECK(log == "efmrw")
+    CHECK(reads == 1000)
+    close(fd);
+    unlink(path);
+}
+
+// Reads from a pipe that's only written to after the read started
+void TestPipe() {
+    int fds[2];
+    CHECK(pipe(fds) == 0)
+    static char buf[16];
+    std::atomic<bool> started = false;
+    int64_t res = 0;
+    sol::Thread* t = sol::Thread::New([&](){
+        sol::io::Read(fds[0], buf, sizeof(buf), -1, [&](int64_t n){
+            res = n;
+        });
+        started = true;
+        sol::CurrentEventLoop()->Run();
+    });
+    while (!started) std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(write(fds[1], "pipe", 4) == 4)
+    t->Wait();
+    CHECK(res == 4 && memcmp(buf, "pipe", 4) == 0)
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Reads a request from a loopback socket and writes the answer back
+void TestSocket() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(bind(listener, (sockaddr*)&addr, sizeof(addr)) == 0 && listen(listener, 1) == 0)
+    socklen_t size = sizeof(addr);
+    getsockname(listener, (sockaddr*)&addr, &size);
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(connect(client, (sockaddr*)&addr, sizeof(addr)) == 0)
+    int server = accept(listener, NULL, NULL);
+    CHECK(server >= 0)
+    static char buf[16];
+    std::string log;
+    sol::Thread* t = sol::Thread::New([&](){
+        sol::io::Read(server, buf, sizeof(buf), -1, [&](int64_t n){
+            CHECK(n == 4 && memcmp(buf, "ping", 4) == 0)
+            log += "r";
+            sol::io::Write(server, "pong", 4, -1, [&](int64_t n){
+                CHECK(n == 4)
+                log += "w";
+            });
+        });
+        sol::CurrentEventLoop()->Run();
+    });
+    CHECK(write(client, "ping", 4) == 4)
+    t->Wait();
+    char answer[4];
+    CHECK(read(client, answer, 4) == 4 && memcmp(answer, "pong", 4) == 0)
+    CHECK(log == "rw")
+    close(client);
+    close(server);
+    close(listener);
+}
+
+// Tears down while a read is still in flight, which has to wait for it instead of hanging
+void TestTeardown() {
+    int fds[2];
+    CHECK(pipe(fds) == 0)
+    static char buf[16];
+    std::atomic<bool> started = false;
+    int64_t res = 0;
+    sol::Thread::New([&](){
+        sol::io::Read(fds[0], buf, sizeof(buf), -1, [&](int64_t n){
+            res = n;
+        });
+        started = true;
+        sol::CurrentEventLoop()->Run();
+    });
+    while (!started) std::this_thread::yield();
+    std::thread writer([&](){
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK(write(fds[1], "late", 4) == 4)
+    });
+    sol::Teardown();
+    writer.join();
+    CHECK(res == 4)
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main() {
+    sol::Init();
+    printf("io: %s\n", sol::io::UsingIoUring() ? "io_uring" : "epoll");
+#if defined(SOL_NO_IO_URING)
+    CHECK(!sol::io::UsingIoUring())
+#endif
+    TestFile();
+    TestPipe();
+    TestSocket();
+    TestTeardown();
+    puts("ok");
+}